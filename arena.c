@@ -0,0 +1,190 @@
+#include "arena.h"
+#include <stdlib.h>
+
+// Blocks come in multiples of ARENA_ALIGN bytes, and each multiple up to
+// ARENA_CLASSES of them has its own free list. Bigger blocks share one list
+// and are reused first fit, which can leave a bit of a block unused until
+// the arena goes.
+#define ARENA_ALIGN 16
+#define ARENA_CLASSES 16
+#define ARENA_CHUNK 65536
+
+typedef struct arena_chunk
+{
+	struct arena_chunk * next;
+	size_t used;
+	size_t capacity;
+	// keeps bytes aligned to ARENA_ALIGN
+	size_t pad;
+	char bytes[];
+} arena_chunk;
+
+// A freed block, stored in the block itself
+typedef struct free_block
+{
+	struct free_block * next;
+	size_t size;
+} free_block;
+
+struct arena
+{
+	arena_chunk * chunks;
+	free_block * free_lists[ARENA_CLASSES];
+	free_block * free_large;
+};
+
+static size_t round_block(size_t size);
+static arena_chunk * add_chunk(arena * keys, size_t capacity);
+
+arena * construct_arena(void)
+{
+	arena * keys = malloc(sizeof(arena));
+	keys->chunks = 0;
+	int i = 0;
+	for(; i < ARENA_CLASSES; i++)
+	{
+		keys->free_lists[i] = 0;
+	}
+	keys->free_large = 0;
+	return keys;
+}
+
+void free_arena(arena * keys)
+{
+	arena_chunk * chunk = keys->chunks;
+	while(chunk != 0)
+	{
+		arena_chunk * next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(keys);
+}
+
+void * arena_alloc(arena * keys, size_t size)
+{
+	size = round_block(size);
+	size_t class = size / ARENA_ALIGN - 1;
+
+	// Reuse a freed block if there's one big enough
+	if(class < ARENA_CLASSES)
+	{
+		free_block * block = keys->free_lists[class];
+		if(block != 0)
+		{
+			keys->free_lists[class] = block->next;
+			return block;
+		}
+	}
+	else
+	{
+		free_block ** link = &keys->free_large;
+		for(; *link != 0; link = &(*link)->next)
+		{
+			if((*link)->size >= size)
+			{
+				free_block * block = *link;
+				*link = block->next;
+				return block;
+			}
+		}
+	}
+
+	// Anything bigger than a chunk gets a chunk of its own, kept behind the
+	// one being bumped
+	arena_chunk * chunk = keys->chunks;
+	if(size > ARENA_CHUNK)
+	{
+		chunk = add_chunk(keys, size);
+		if(chunk->next != 0)
+		{
+			keys->chunks = chunk->next;
+			chunk->next = keys->chunks->next;
+			keys->chunks->next = chunk;
+		}
+		chunk->used = size;
+		return chunk->bytes;
+	}
+
+	// Otherwise bump the newest chunk. A block that doesn't fit starts a
+	// new one, and the rest of the old one is never used - chunks are big
+	// enough next to keys for that not to matter.
+	if(chunk == 0 || chunk->capacity - chunk->used < size)
+	{
+		chunk = add_chunk(keys, ARENA_CHUNK);
+	}
+	void * block = chunk->bytes + chunk->used;
+	chunk->used += size;
+	return block;
+}
+
+void arena_free(arena * keys, void * block, size_t size)
+{
+	free_block * freed = block;
+	freed->size = round_block(size);
+	size_t class = freed->size / ARENA_ALIGN - 1;
+	free_block ** list = class < ARENA_CLASSES ? &keys->free_lists[class]
+		: &keys->free_large;
+	freed->next = *list;
+	*list = freed;
+}
+
+void arena_merge(arena * into, arena * from)
+{
+	// from's chunks go behind into's newest one, which keeps being bumped
+	arena_chunk * chunk = from->chunks;
+	if(chunk != 0)
+	{
+		while(chunk->next != 0)
+		{
+			chunk = chunk->next;
+		}
+		if(into->chunks == 0)
+		{
+			into->chunks = from->chunks;
+		}
+		else
+		{
+			chunk->next = into->chunks->next;
+			into->chunks->next = from->chunks;
+		}
+	}
+
+	int i = 0;
+	for(; i <= ARENA_CLASSES; i++)
+	{
+		free_block ** list = i < ARENA_CLASSES ? &from->free_lists[i]
+			: &from->free_large;
+		free_block ** other = i < ARENA_CLASSES ? &into->free_lists[i]
+			: &into->free_large;
+		while(*list != 0)
+		{
+			free_block * block = *list;
+			*list = block->next;
+			block->next = *other;
+			*other = block;
+		}
+	}
+
+	free(from);
+}
+
+// Every block is at least big enough to hold a free_block
+static size_t round_block(size_t size)
+{
+	if(size < sizeof(free_block))
+	{
+		size = sizeof(free_block);
+	}
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static arena_chunk * add_chunk(arena * keys, size_t capacity)
+{
+	arena_chunk * chunk = malloc(sizeof(arena_chunk) + capacity);
+	chunk->used = 0;
+	chunk->capacity = capacity;
+	chunk->next = keys->chunks;
+	keys->chunks = chunk;
+	return chunk;
+}
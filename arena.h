@@ -0,0 +1,28 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+// A map's key storage. Blocks are bump-allocated out of large chunks, so a
+// map's keys sit close together and free_arena() releases all of them with
+// one free() per chunk. Freed blocks go on a free list for their size class
+// and are handed out again before the chunk is bumped any further.
+// Not stored in the header, hash.h only holds a void pointer to it.
+typedef struct arena arena;
+
+arena * construct_arena(void);
+
+// Releases every block at once - blocks don't need freeing first
+void free_arena(arena *);
+
+// size bytes, aligned for a pointer or a size_t
+void * arena_alloc(arena *, size_t size);
+
+// Hands a block back for reuse. size must be what it was allocated with.
+void arena_free(arena *, void * block, size_t size);
+
+// Moves every block of from, in use or freed, into into and frees from -
+// e.g. to fill arenas on several threads and keep them as one
+void arena_merge(arena * into, arena * from);
+
+#endif /* ARENA_H_INCLUDED */
@@ -0,0 +1,406 @@
+#include "hash.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+// Throughput benchmark for the hash map: ns per set(), get() of a key
+// that's there (picked uniformly, or Zipfian so a few keys get most of the
+// lookups), get() of a key that isn't, and delete(). Each is measured in
+// fixed-size maps filled to a load factor, for each table size, load
+// factor and kind of key asked for. Every number is the median of several
+// trials, each in a new map, with a pass over the keys first to warm up.
+
+const static char * help = "Benchmarks set(), get() and delete() on maps "\
+	"of the sizes, load factors and keys given (all of them by default), "\
+	"printing the median ns per operation over the trials.\n";
+const static char * help_flags = "FLAGS:\n"\
+	"\t-S max:\tLargest table size, from 1000 up by tens (default 1000000,"\
+	" up to 100000000).\n"\
+	"\t-l load:\tOnly this load factor (default 0.5, 0.75, 0.9, 0.99).\n"\
+	"\t-k keys:\tOnly id (8 bytes), word (Test%%d) or url (40+ bytes).\n"\
+	"\t-p probing:\tlinear (default), group or robin.\n"\
+	"\t-r reduction:\tmodulo (default), pow2, fastrange or prime.\n"\
+	"\t-f hash:\tcfarmhash (default), superfasthash or short.\n"\
+	"\t-t trials:\tTrials per measurement (default 5).\n"\
+	"\t-b ms:\tTime to spend on each get() measurement (default 50).\n"\
+	"\t-h:\tDisplays this message.\n";
+
+// Lookups are timed in batches of this many, and the run of keys they
+// follow repeats after LOOKUPS of them
+#define BATCH 256
+#define LOOKUPS (1 << 20)
+// Small maps are filled and emptied again until this many set()s have
+// been timed, so there's something to measure
+#define MIN_SETS (1 << 18)
+#define ZIPF_EXPONENT 0.99
+#define MAX_TRIALS 32
+
+static const char * key_kinds[] = {"id", "word", "url"};
+static const double default_loads[] = {0.5, 0.75, 0.9, 0.99};
+
+typedef struct
+{
+	char * bytes;
+	const char ** keys;
+	size_t * lens;
+	size_t count;
+} key_set;
+
+typedef struct
+{
+	double set;
+	double get;
+	double get_zipf;
+	double get_miss;
+	double delete;
+} result;
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// splitmix64, for keys and lookup orders that are the same on every run
+static uint64_t next_random(uint64_t * state)
+{
+	uint64_t x = (*state += UINT64_C(0x9E3779B97F4A7C15));
+	x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+// The longest key of each kind, with its '\0'
+static size_t longest_key(const char * kind)
+{
+	return strcmp(kind, "id") == 0 ? 9 : strcmp(kind, "word") == 0 ? 15 : 64;
+}
+
+// count keys of a kind. Misses are made the same way from other numbers.
+static key_set make_keys(const char * kind, size_t count, int misses)
+{
+	key_set set;
+	set.count = count;
+	set.bytes = malloc(count * longest_key(kind));
+	set.keys = malloc(count * sizeof(char *));
+	set.lens = malloc(count * sizeof(size_t));
+	uint64_t state = misses ? 2 : 1;
+	char * at = set.bytes;
+	size_t i = 0;
+	for(; i < count; i++)
+	{
+		uint32_t number = misses ? count + i : i;
+		int len;
+		if(strcmp(kind, "id") == 0)
+		{
+			// Fixed-width IDs, not in order: multiplying by an odd number
+			// and xor-shifting both map 32 bits onto 32 bits one to one
+			number *= UINT32_C(0x9E3779B1);
+			number ^= number >> 15;
+			len = sprintf(at, "%08x", number);
+		}
+		else if(strcmp(kind, "word") == 0)
+		{
+			len = sprintf(at, "Test%u", number);
+		}
+		else
+		{
+			len = sprintf(at, "https://example.com/items/%u/view?ref=%016llx",
+				number, (unsigned long long)next_random(&state));
+		}
+		set.keys[i] = at;
+		set.lens[i] = len;
+		at += len + 1;
+	}
+	return set;
+}
+
+static void free_keys(key_set * set)
+{
+	free(set->bytes);
+	free(set->keys);
+	free(set->lens);
+}
+
+// Which key each lookup asks for. Zipfian ranks come from inverting the
+// continuous power law, which is close enough to the discrete one here,
+// then are scattered over the keys so the hot ones aren't all together.
+static void make_order(uint32_t * order, size_t count, int zipf)
+{
+	uint64_t state = zipf ? 4 : 3;
+	double top = pow((double)count, 1 - ZIPF_EXPONENT) - 1;
+	size_t i = 0;
+	for(; i < LOOKUPS; i++)
+	{
+		uint64_t random = next_random(&state);
+		if(!zipf)
+		{
+			order[i] = random % count;
+			continue;
+		}
+		double u = (random >> 11) * (1.0 / 9007199254740992.0);
+		uint64_t rank = (uint64_t)pow(top * u + 1, 1 / (1 - ZIPF_EXPONENT));
+		uint64_t scatter = rank;
+		order[i] = next_random(&scatter) % count;
+	}
+}
+
+// Times get_n() on keys in order, in batches until budget ns have gone by
+// or every lookup in order has been done. Returns ns per get_n().
+static double time_gets(hash * map, const key_set * keys,
+	const uint32_t * order, double budget)
+{
+	size_t found = 0, done = 0;
+	double start = now(), elapsed = 0;
+	while(done < LOOKUPS && elapsed < budget)
+	{
+		size_t end = done + BATCH;
+		for(; done < end; done++)
+		{
+			uint32_t which = order[done];
+			found += get_n(map, keys->keys[which], keys->lens[which]) != 0;
+		}
+		elapsed = now() - start;
+	}
+	// Keep the lookups from being optimized away
+	if(found == (size_t)-1)
+	{
+		printf("\n");
+	}
+	return elapsed / done;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double median(double * values, int count)
+{
+	qsort(values, count, sizeof(double), compare_doubles);
+	return count % 2 ? values[count / 2]
+		: (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+// One trial: fill maps of size cells to load and empty them again, timing
+// each part
+static result run_trial(int size, double load, const hash_options * options,
+	const key_set * keys, const key_set * misses, const uint32_t * uniform,
+	const uint32_t * zipf, double budget)
+{
+	result trial = {0, 0, 0, 0, 0};
+	double set_time = 0, delete_time = 0;
+	size_t sets = 0;
+	int round = 0;
+	while(round == 0 || sets < MIN_SETS)
+	{
+		hash * map = construct_hash_with(size, options);
+		size_t count = load * map->size;
+		size_t i = 0;
+		double start = now();
+		for(; i < count; i++)
+		{
+			set_n(map, keys->keys[i], keys->lens[i], (void *)keys->keys[i]);
+		}
+		set_time += now() - start;
+		sets += count;
+
+		if(round == 0)
+		{
+			// Warm up on one pass over the keys, then time lookups
+			for(i = 0; i < count; i++)
+			{
+				get_n(map, keys->keys[i], keys->lens[i]);
+			}
+			trial.get = time_gets(map, keys, uniform, budget);
+			trial.get_zipf = time_gets(map, keys, zipf, budget);
+			trial.get_miss = time_gets(map, misses, uniform, budget);
+		}
+
+		start = now();
+		for(i = 0; i < count; i++)
+		{
+			delete_n(map, keys->keys[i], keys->lens[i]);
+		}
+		delete_time += now() - start;
+
+		// Everything's deleted, so there's no data for it to free
+		free_hash(map);
+		round++;
+	}
+	trial.set = set_time / sets;
+	trial.delete = delete_time / sets;
+	return trial;
+}
+
+int main(int argc, char ** argv)
+{
+	long max_size = 1000000;
+	double only_load = 0;
+	const char * only_keys = 0;
+	int trials = 5;
+	double budget = 50e6;
+	hash_options options;
+	memset(&options, 0, sizeof(options));
+	const char * probing = "linear", * reduction = "modulo",
+		* function = "cfarmhash";
+
+	int c;
+	while((c = getopt(argc, argv, "S:l:k:p:r:f:t:b:h")) != -1)
+	{
+		switch(c)
+		{
+			case 'S':
+				max_size = atol(optarg);
+				break;
+			case 'l':
+				only_load = atof(optarg);
+				break;
+			case 'k':
+				only_keys = optarg;
+				break;
+			case 'p':
+				probing = optarg;
+				break;
+			case 'r':
+				reduction = optarg;
+				break;
+			case 'f':
+				function = optarg;
+				break;
+			case 't':
+				trials = atoi(optarg);
+				break;
+			case 'b':
+				budget = atof(optarg) * 1e6;
+				break;
+			case 'h':
+			default:
+				printf("%s\n%s", help, help_flags);
+				return 0;
+		}
+	}
+
+	// Names that aren't any of these are as bad as numbers out of range
+	int unknown = only_keys != 0 && strcmp(only_keys, "id") != 0
+		&& strcmp(only_keys, "word") != 0 && strcmp(only_keys, "url") != 0;
+	if(strcmp(probing, "group") == 0)
+	{
+		options.probing = PROBE_GROUP;
+	}
+	else if(strcmp(probing, "robin") == 0)
+	{
+		options.probing = PROBE_ROBIN_HOOD;
+	}
+	else if(strcmp(probing, "linear") != 0)
+	{
+		unknown = 1;
+	}
+	if(strcmp(reduction, "pow2") == 0)
+	{
+		options.reduction = REDUCE_POW2;
+	}
+	else if(strcmp(reduction, "fastrange") == 0)
+	{
+		options.reduction = REDUCE_FASTRANGE;
+	}
+	else if(strcmp(reduction, "prime") == 0)
+	{
+		options.reduction = REDUCE_PRIME;
+	}
+	else if(strcmp(reduction, "modulo") != 0)
+	{
+		unknown = 1;
+	}
+	if(strcmp(function, "superfasthash") == 0)
+	{
+		options.hash_with = hash_superfasthash;
+	}
+	else if(strcmp(function, "short") == 0)
+	{
+		options.hash_with = hash_short_key;
+	}
+	else if(strcmp(function, "cfarmhash") != 0)
+	{
+		unknown = 1;
+	}
+	if(unknown || max_size < 1000 || max_size > 100000000 || trials < 1
+		|| trials > MAX_TRIALS || only_load < 0 || only_load >= 1)
+	{
+		printf("%s\n%s", help, help_flags);
+		return 1;
+	}
+
+	printf("probing %s, reduction %s, hash %s; median ns/op of %d trials\n",
+		probing, reduction, function, trials);
+	printf("%10s %5s %5s %8s %8s %8s %8s %8s\n", "size", "load", "keys",
+		"set", "get", "get-zipf", "get-miss", "delete");
+
+	uint32_t * uniform = malloc(LOOKUPS * sizeof(uint32_t));
+	uint32_t * zipf = malloc(LOOKUPS * sizeof(uint32_t));
+	int kind = 0;
+	for(; kind < 3; kind++)
+	{
+		if(only_keys != 0 && strcmp(only_keys, key_kinds[kind]) != 0)
+		{
+			continue;
+		}
+		long size = 1000;
+		for(; size <= max_size; size *= 10)
+		{
+			// Rounding can add cells, so make enough keys for the most
+			// the rounded size holds
+			hash * probe = construct_hash_with(size, &options);
+			unsigned long probe_size = probe->size;
+			size_t most = (only_load != 0 ? only_load : 0.99) * probe_size;
+			free_hash(probe);
+			key_set keys = make_keys(key_kinds[kind], most + 1, 0);
+			key_set misses = make_keys(key_kinds[kind], most + 1, 1);
+			int l = 0;
+			for(; l < 4; l++)
+			{
+				double load = only_load != 0 ? only_load : default_loads[l];
+				size_t count = load * probe_size;
+				if(count == 0)
+				{
+					continue;
+				}
+				make_order(uniform, count, 0);
+				make_order(zipf, count, 1);
+
+				double times[5][MAX_TRIALS];
+				int t = 0;
+				for(; t < trials; t++)
+				{
+					result trial = run_trial(size, load, &options, &keys,
+						&misses, uniform, zipf, budget);
+					times[0][t] = trial.set;
+					times[1][t] = trial.get;
+					times[2][t] = trial.get_zipf;
+					times[3][t] = trial.get_miss;
+					times[4][t] = trial.delete;
+				}
+				printf("%10ld %5.2f %5s %8.1f %8.1f %8.1f %8.1f %8.1f\n", size,
+					load, key_kinds[kind], median(times[0], trials),
+					median(times[1], trials), median(times[2], trials),
+					median(times[3], trials), median(times[4], trials));
+				fflush(stdout);
+				if(only_load != 0)
+				{
+					break;
+				}
+			}
+			free_keys(&keys);
+			free_keys(&misses);
+		}
+	}
+	free(uniform);
+	free(zipf);
+	return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include "cfarmhash.h"
 
 #define bswap32(x) __builtin_bswap32(x)
 #define bswap64(x) __builtin_bswap64(x)
@@ -210,3 +211,179 @@ uint64_t cfarmhash(const char *s, size_t len)
 		     hash_len_16(v.second, w.second, mul) + x,
 		     mul);
 }
+
+uint64_t cfarmhash_with_seed(const char *s, size_t len, uint64_t seed)
+{
+  return hash_len_16(cfarmhash(s, len) - k2, seed, 0x9ddfea08eb382d69ULL);
+}
+
+// cfarmhash() for n keys at once. Built with make CFARMHASH_SIMD=1
+// (-DCFARMHASH_SIMD) on x86, keys of 4 to 16 bytes - most keys - go
+// through hash_len_0_to_16() four at a time, one key to each 64-bit lane
+// of an AVX2 register, where the CPU has AVX2. It only multiplies 32 bits by 32, so a 64-bit multiply takes three
+// of those; where the CPU has AVX-512 its own 64-bit multiplies and
+// rotates are used instead (on the same 256-bit registers, which don't
+// slow the clock the way 512-bit ones can). Every lane does exactly what
+// the scalar code does, so the hashes are the same bit for bit. It's off
+// by default because the multiplies cost about what they save: measured,
+// four keys in lanes were no faster than four cfarmhash() calls, which
+// the CPU already overlaps. Otherwise, and for other lengths, this is
+// cfarmhash() on each key.
+
+// See cfarmhash_many_lanes()
+static int most_lanes = CFARMHASH_AVX512;
+
+#if defined(CFARMHASH_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define LANES 4
+
+typedef void (*lanes_function)(const char * const *, const size_t *, int,
+			       uint64_t *);
+
+static inline __attribute__((target("avx2")))
+__m256i mul64_avx2(__m256i a, __m256i b)
+{
+  __m256i low = _mm256_mul_epu32(a, b);
+  __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+				   _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+
+  return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+#define ror64_avx2(v, shift) \
+  _mm256_or_si256(_mm256_srli_epi64(v, shift), _mm256_slli_epi64(v, 64 - (shift)))
+#define mul64_avx512(a, b) _mm256_mullo_epi64(a, b)
+#define ror64_avx512(v, shift) _mm256_ror_epi64(v, shift)
+
+// hash_len_0_to_16() on keys[0] to keys[3], which are all 8 to 16 bytes
+// long, or all 4 to 7 if short_keys is set
+#define HASH_LANES(name, isa, mul64, ror64)				\
+  static __attribute__((target(isa)))					\
+  void name(const char * const *keys, const size_t *lens,		\
+	    int short_keys, uint64_t *out)				\
+  {									\
+    uint64_t first[LANES], last[LANES], len[LANES];			\
+    int i;								\
+									\
+    for (i = 0; i < LANES; i++)					\
+      {									\
+	const char *s = keys[i];					\
+	len[i] = lens[i];						\
+	first[i] = short_keys ? fetch32(s) : fetch64(s);		\
+	last[i] = short_keys ? fetch32(s + len[i] - 4)			\
+	  : fetch64(s + len[i] - 8);					\
+      }									\
+									\
+    /* Set from registers: loading what was just stored stalls */	\
+    __m256i k = _mm256_set1_epi64x((long long) k2);			\
+    __m256i l = _mm256_set_epi64x(len[3], len[2], len[1], len[0]);	\
+    __m256i mul = _mm256_add_epi64(k, _mm256_add_epi64(l, l));	\
+    __m256i a = _mm256_set_epi64x(first[3], first[2], first[1],	\
+				  first[0]);				\
+    __m256i b = _mm256_set_epi64x(last[3], last[2], last[1], last[0]);	\
+    __m256i c, d;							\
+									\
+    if (short_keys)							\
+      {									\
+	c = _mm256_add_epi64(l, _mm256_slli_epi64(a, 3));		\
+	d = b;								\
+      }									\
+    else								\
+      {									\
+	a = _mm256_add_epi64(a, k);					\
+	c = _mm256_add_epi64(mul64(ror64(b, 37), mul), a);		\
+	d = mul64(_mm256_add_epi64(ror64(a, 25), b), mul);		\
+      }									\
+									\
+    /* hash_len_16(c, d, mul) */					\
+    a = mul64(_mm256_xor_si256(c, d), mul);				\
+    a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));		\
+    b = mul64(_mm256_xor_si256(d, a), mul);				\
+    b = _mm256_xor_si256(b, _mm256_srli_epi64(b, 47));		\
+    b = mul64(b, mul);							\
+    _mm256_storeu_si256((__m256i *) out, b);				\
+  }
+
+HASH_LANES(hash_lanes_avx2, "avx2", mul64_avx2, ror64_avx2)
+HASH_LANES(hash_lanes_avx512, "avx2,avx512f,avx512dq,avx512vl",
+	   mul64_avx512, ror64_avx512)
+
+static int supported_lanes(int most)
+{
+  if (most >= CFARMHASH_AVX512 && __builtin_cpu_supports("avx512dq")
+      && __builtin_cpu_supports("avx512vl"))
+    return CFARMHASH_AVX512;
+
+  if (most >= CFARMHASH_AVX2 && __builtin_cpu_supports("avx2"))
+    return CFARMHASH_AVX2;
+
+  return CFARMHASH_SCALAR;
+}
+
+static lanes_function pick_lanes(void)
+{
+  switch (supported_lanes(most_lanes))
+    {
+    case CFARMHASH_AVX512:
+      return hash_lanes_avx512;
+    case CFARMHASH_AVX2:
+      return hash_lanes_avx2;
+    default:
+      return 0;
+    }
+}
+
+// Which lanes a key of len bytes can go in: 1 for 4 to 7 bytes, 0 for 8 to
+// 16, and -1 for none
+#define lane_kind(len) ((len) < 4 || (len) > 16 ? -1 : (len) < 8)
+#endif
+
+int cfarmhash_many_lanes(int most)
+{
+  most_lanes = most;
+#ifdef LANES
+  return supported_lanes(most);
+#else
+  return CFARMHASH_SCALAR;
+#endif
+}
+
+void cfarmhash_many(const char * const *keys, const size_t *lens, size_t n,
+		    uint64_t *out)
+{
+  size_t i = 0;
+
+#ifdef LANES
+  lanes_function lanes = pick_lanes();
+
+  // Each four keys in a row that fit the same lanes go together; keys are
+  // usually much alike in length, so most do
+  for (; lanes && i + LANES <= n; i += LANES)
+    {
+      int kind = lane_kind(lens[i]);
+      if (kind != -1 && kind == lane_kind(lens[i + 1])
+	  && kind == lane_kind(lens[i + 2]) && kind == lane_kind(lens[i + 3]))
+	lanes(keys + i, lens + i, kind, out + i);
+      else
+	{
+	  int j = 0;
+	  for (; j < LANES; j++)
+	    out[i + j] = cfarmhash(keys[i + j], lens[i + j]);
+	}
+    }
+#endif
+
+  for (; i < n; i++)
+    out[i] = cfarmhash(keys[i], lens[i]);
+}
+
+void cfarmhash_many_with_seed(const char * const *keys, const size_t *lens,
+			      size_t n, uint64_t seed, uint64_t *out)
+{
+  size_t i = 0;
+
+  cfarmhash_many(keys, lens, n, out);
+  for (; i < n; i++)
+    out[i] = hash_len_16(out[i] - k2, seed, 0x9ddfea08eb382d69ULL);
+}
@@ -2,5 +2,18 @@
 #define SHEEPHASH_H_INCLUDED
 
 uint64_t cfarmhash(const char *, size_t);
+uint64_t cfarmhash_with_seed(const char *, size_t, uint64_t);
+// The same hashes for n keys at once, into out; see cfarmhash.c
+void cfarmhash_many(const char * const *, const size_t *, size_t, uint64_t *);
+void cfarmhash_many_with_seed(const char * const *, const size_t *, size_t,
+	uint64_t, uint64_t *);
+// Caps which lanes cfarmhash_many() uses (all it can, to start with), so
+// tests can run each of them. Not thread-safe. Returns the lanes it will
+// use from now on: CFARMHASH_SCALAR unless built with CFARMHASH_SIMD on a
+// CPU that has the others.
+#define CFARMHASH_SCALAR 0
+#define CFARMHASH_AVX2 1
+#define CFARMHASH_AVX512 2
+int cfarmhash_many_lanes(int most);
 
 #endif /* SHEEPHASH_H_INCLUDED */
@@ -0,0 +1,431 @@
+#include "concurrent.h"
+#include "epoch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// Stripes are padded out to a cache line each, so threads working on
+// neighbouring stripes don't keep taking the line from each other.
+#define CACHE_LINE 64
+
+// Stripes of maps with lock-free reads keep their cells in a read_table
+// instead of a hash. Cells only ever change by swapping a single pointer,
+// so a reader sees each cell either before or after a write, never half
+// way through one. Entries are never moved or changed once a reader can
+// see them, apart from their datum - set() swaps it in place.
+typedef struct
+{
+	uint64_t hashed_key;
+	void * _Atomic datum;
+	size_t len;
+	char key[];
+} read_entry;
+
+// In a read_table cell, a deleted entry. Probes go past it like was_used.
+static char removed_cell;
+#define REMOVED ((read_entry *)&removed_cell)
+
+// Power-of-two sized, and rebuilt into a new table before more than
+// READ_FULL_AT of its cells are full or removed, so probes always reach a
+// null cell. Writers replace the whole table rather than reuse removed
+// cells in place of a rebuild, so readers never see a table change size.
+#define READ_FULL_AT 0.75
+typedef struct
+{
+	unsigned long size;
+	unsigned long in_use;
+	// full and removed cells
+	unsigned long used;
+	read_entry * _Atomic cells[];
+} read_table;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	// One or the other, depending on lock_free_reads
+	hash * map;
+	read_table * _Atomic table;
+} __attribute__((aligned(CACHE_LINE))) stripe;
+
+// The stripe a key belongs to
+#define stripe_of(table, h) \
+	(&((stripe *)(table)->stripes)[hash_partition(h, (table)->bits)])
+
+static concurrent_hash * construct_stripes(int size, int stripes,
+	const hash_options * options, int lock_free_reads);
+static read_table * alloc_read_table(unsigned long min_size);
+static read_entry * read_index(read_table * table, uint64_t h,
+	const char * key, size_t len, long * at, long * first_free);
+static int read_set(concurrent_hash * map, stripe * s, const char * key,
+	size_t len, uint64_t h, void * element);
+static void * read_get(stripe * s, const char * key, size_t len, uint64_t h);
+static void * read_delete(concurrent_hash * map, stripe * s, const char * key,
+	size_t len, uint64_t h);
+
+concurrent_hash * construct_concurrent_hash(int size, int stripes,
+	const hash_options * options)
+{
+	return construct_stripes(size, stripes, options, 0);
+}
+
+concurrent_hash * construct_concurrent_hash_lock_free(int size, int stripes)
+{
+	return construct_stripes(size, stripes, 0, 1);
+}
+
+static concurrent_hash * construct_stripes(int size, int stripes,
+	const hash_options * options, int lock_free_reads)
+{
+	if(size < 0 || stripes <= 0)
+	{
+		return 0;
+	}
+
+	// Round stripes up to a power of two, at most 2^31 of them
+	unsigned int bits = 0;
+	while((1u << bits) < (unsigned int)stripes && bits < 31)
+	{
+		bits++;
+	}
+
+	concurrent_hash * map = malloc(sizeof(concurrent_hash));
+	map->count = 1u << bits;
+	map->bits = bits;
+	map->lock_free_reads = lock_free_reads;
+	// Keys are hashed here, then handed to a stripe, so no stripe can
+	// reseed on its own
+	hash_options stripe_options = {0};
+	if(options)
+	{
+		stripe_options = *options;
+	}
+	if(stripe_options.reseed_at != 0 && stripe_options.seed == 0)
+	{
+		stripe_options.seed = hash_random_seed();
+	}
+	if(stripe_options.reseed_at != 0 && stripe_options.hash_with == 0)
+	{
+		stripe_options.hash_with = hash_short_key;
+	}
+	stripe_options.reseed_at = 0;
+	map->hash_with = stripe_options.hash_with ? stripe_options.hash_with
+		: hash_cfarmhash;
+	map->seed = stripe_options.seed;
+
+	void * memory;
+	if(posix_memalign(&memory, CACHE_LINE, map->count * sizeof(stripe)))
+	{
+		free(map);
+		return 0;
+	}
+	map->stripes = memory;
+	map->limbo = construct_epoch_limbo();
+
+	// Every stripe gets its share of the cells, rounded up
+	int per_stripe = (size + map->count - 1) / map->count;
+	unsigned int i = 0;
+	for(; i < map->count; i++)
+	{
+		stripe * s = &((stripe *)map->stripes)[i];
+		pthread_mutex_init(&s->lock, 0);
+		if(lock_free_reads)
+		{
+			s->map = 0;
+			atomic_init(&s->table, alloc_read_table(per_stripe));
+		}
+		else
+		{
+			s->map = construct_hash_with(per_stripe, &stripe_options);
+			atomic_init(&s->table, 0);
+		}
+	}
+
+	return map;
+}
+
+void free_concurrent_hash(concurrent_hash * map)
+{
+	// Deferred frees first - they may be of data still in the cells'
+	// old entries, but never of data that's still in the map
+	free_epoch_limbo(map->limbo);
+
+	unsigned int i = 0;
+	for(; i < map->count; i++)
+	{
+		stripe * s = &((stripe *)map->stripes)[i];
+		if(map->lock_free_reads)
+		{
+			read_table * table = atomic_load(&s->table);
+			unsigned long c = 0;
+			for(; c < table->size; c++)
+			{
+				read_entry * entry = atomic_load(&table->cells[c]);
+				if(entry != 0 && entry != REMOVED)
+				{
+					free(atomic_load(&entry->datum));
+					free(entry);
+				}
+			}
+			free(table);
+		}
+		else
+		{
+			free_hash(s->map);
+		}
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(map->stripes);
+	free(map);
+}
+
+// Keys are hashed before taking the lock, so the lock is only held for the
+// probe itself
+int concurrent_set(concurrent_hash * map, const char * key, void * element)
+{
+	size_t len = strlen(key);
+	uint64_t h = map->hash_with(key, len, map->seed);
+	stripe * s = stripe_of(map, h);
+
+	pthread_mutex_lock(&s->lock);
+	int result = map->lock_free_reads
+		? read_set(map, s, key, len, h, element)
+		: set_prehashed(s->map, key, len, h, element);
+	pthread_mutex_unlock(&s->lock);
+	return result;
+}
+
+void * concurrent_get(concurrent_hash * map, const char * key)
+{
+	size_t len = strlen(key);
+	uint64_t h = map->hash_with(key, len, map->seed);
+	stripe * s = stripe_of(map, h);
+
+	if(map->lock_free_reads)
+	{
+		epoch_enter();
+		void * datum = read_get(s, key, len, h);
+		epoch_exit();
+		return datum;
+	}
+
+	// get() moves cells along while a stripe grows, so it needs the lock
+	// as much as set() does
+	pthread_mutex_lock(&s->lock);
+	void * datum = get_prehashed(s->map, key, len, h);
+	pthread_mutex_unlock(&s->lock);
+	return datum;
+}
+
+void * concurrent_delete(concurrent_hash * map, const char * key)
+{
+	size_t len = strlen(key);
+	uint64_t h = map->hash_with(key, len, map->seed);
+	stripe * s = stripe_of(map, h);
+
+	pthread_mutex_lock(&s->lock);
+	void * datum = map->lock_free_reads
+		? read_delete(map, s, key, len, h)
+		: delete_prehashed(s->map, key, len, h);
+	pthread_mutex_unlock(&s->lock);
+	return datum;
+}
+
+void concurrent_enter(concurrent_hash * map)
+{
+	epoch_enter();
+}
+
+void concurrent_exit(concurrent_hash * map)
+{
+	epoch_exit();
+}
+
+void concurrent_defer(concurrent_hash * map, void * datum,
+	void (*fn)(void *))
+{
+	epoch_defer(map->limbo, datum, fn);
+}
+
+// Each stripe keeps its own in_use, so writers never share a counter
+float concurrent_load(concurrent_hash * map)
+{
+	unsigned long in_use = 0, size = 0;
+	unsigned int i = 0;
+	for(; i < map->count; i++)
+	{
+		stripe * s = &((stripe *)map->stripes)[i];
+		pthread_mutex_lock(&s->lock);
+		if(map->lock_free_reads)
+		{
+			read_table * table = atomic_load(&s->table);
+			in_use += table->in_use;
+			size += table->size;
+		}
+		else
+		{
+			in_use += s->map->in_use;
+			size += s->map->size;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	return ((float)in_use)/size;
+}
+
+// An empty table with room for min_size entries before it needs rebuilding
+static read_table * alloc_read_table(unsigned long min_size)
+{
+	unsigned long size = 8;
+	while(size * READ_FULL_AT < min_size + 1)
+	{
+		size *= 2;
+	}
+	read_table * table = malloc(sizeof(read_table)
+		+ size * sizeof(read_entry *));
+	table->size = size;
+	table->in_use = 0;
+	table->used = 0;
+	unsigned long i = 0;
+	for(; i < size; i++)
+	{
+		atomic_init(&table->cells[i], 0);
+	}
+	return table;
+}
+
+// The entry for the key, or a null pointer. It's the entry that was
+// compared, not whatever the cell holds by now, so readers can use it even
+// if a writer has removed or replaced it since. For writers, at is set to
+// its cell and first_free to the first removed or null cell on the way -
+// readers pass null pointers.
+static read_entry * read_index(read_table * table, uint64_t h,
+	const char * key, size_t len, long * at, long * first_free)
+{
+	unsigned long mask = table->size - 1;
+	unsigned long index = h & mask;
+	if(first_free != 0)
+	{
+		*first_free = -1;
+	}
+
+	// There's always a null cell, so this ends
+	for(;; index = (index + 1) & mask)
+	{
+		read_entry * entry = atomic_load_explicit(&table->cells[index],
+			memory_order_acquire);
+		if(entry == 0 || entry == REMOVED)
+		{
+			if(first_free != 0 && *first_free == -1)
+			{
+				*first_free = index;
+			}
+			if(entry == 0)
+			{
+				return 0;
+			}
+		}
+		else if((entry->hashed_key == h) && (entry->len == len)
+			&& (memcmp(entry->key, key, len) == 0))
+		{
+			if(at != 0)
+			{
+				*at = index;
+			}
+			return entry;
+		}
+	}
+}
+
+// Readers take no lock and write nothing but their own epoch record
+static void * read_get(stripe * s, const char * key, size_t len, uint64_t h)
+{
+	read_table * table = atomic_load_explicit(&s->table,
+		memory_order_acquire);
+	read_entry * entry = read_index(table, h, key, len, 0, 0);
+	if(entry == 0)
+	{
+		return 0;
+	}
+	// Deleted since we found it? Then it's still ours until epoch_exit()
+	return atomic_load_explicit(&entry->datum, memory_order_acquire);
+}
+
+// Writers hold the stripe's lock
+static int read_set(concurrent_hash * map, stripe * s, const char * key,
+	size_t len, uint64_t h, void * element)
+{
+	read_table * table = atomic_load_explicit(&s->table,
+		memory_order_relaxed);
+	long first_free;
+	read_entry * found = read_index(table, h, key, len, 0, &first_free);
+	if(found != 0)
+	{
+		atomic_store_explicit(&found->datum, element, memory_order_release);
+		return 1;
+	}
+
+	// Rebuild before a null cell is filled past READ_FULL_AT. Readers
+	// may still be probing the old table, so it waits for them.
+	read_entry * free_cell = atomic_load_explicit(&table->cells[first_free],
+		memory_order_relaxed);
+	if(free_cell == 0 && table->used + 1 > table->size * READ_FULL_AT)
+	{
+		read_table * rebuilt = alloc_read_table(table->in_use * 2);
+		unsigned long i = 0;
+		for(; i < table->size; i++)
+		{
+			read_entry * entry = atomic_load_explicit(&table->cells[i],
+				memory_order_relaxed);
+			if(entry != 0 && entry != REMOVED)
+			{
+				long to;
+				read_index(rebuilt, entry->hashed_key, entry->key, entry->len,
+					0, &to);
+				atomic_store_explicit(&rebuilt->cells[to], entry,
+					memory_order_relaxed);
+			}
+		}
+		rebuilt->in_use = rebuilt->used = table->in_use;
+		atomic_store_explicit(&s->table, rebuilt, memory_order_release);
+		epoch_defer(map->limbo, table, free);
+
+		table = rebuilt;
+		read_index(table, h, key, len, 0, &first_free);
+		free_cell = 0;
+	}
+
+	read_entry * entry = malloc(sizeof(read_entry) + len);
+	entry->hashed_key = h;
+	atomic_init(&entry->datum, element);
+	entry->len = len;
+	memcpy(entry->key, key, len);
+	// Publishes the whole entry along with the pointer
+	atomic_store_explicit(&table->cells[first_free], entry,
+		memory_order_release);
+	table->in_use++;
+	if(free_cell == 0)
+	{
+		table->used++;
+	}
+	return 1;
+}
+
+static void * read_delete(concurrent_hash * map, stripe * s, const char * key,
+	size_t len, uint64_t h)
+{
+	read_table * table = atomic_load_explicit(&s->table,
+		memory_order_relaxed);
+	long index;
+	read_entry * entry = read_index(table, h, key, len, &index, 0);
+	if(entry == 0)
+	{
+		return 0;
+	}
+	void * datum = atomic_load_explicit(&entry->datum, memory_order_relaxed);
+	atomic_store_explicit(&table->cells[index], REMOVED,
+		memory_order_release);
+	table->in_use--;
+	// Readers may have the entry in hand, so it goes once they're done.
+	// The datum is the caller's now, for concurrent_defer().
+	epoch_defer(map->limbo, entry, free);
+	return datum;
+}
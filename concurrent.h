@@ -0,0 +1,71 @@
+#ifndef CONCURRENT_H_INCLUDED
+#define CONCURRENT_H_INCLUDED
+
+#include "hash.h"
+
+// A map that any number of threads can use at once. Its cells are split
+// into stripes, each a map of its own behind its own lock, and every key
+// belongs to the stripe picked by its hash. Threads only wait on each other
+// when their keys land in the same stripe, so with enough stripes they
+// rarely do. Data is still owned by the map, as with hash.
+// Maps constructed with construct_concurrent_hash_lock_free() don't lock
+// for get() at all - see there.
+typedef struct
+{
+	// The stripes, each on its own cache line
+	void * stripes;
+	unsigned int count;
+	// log2(count)
+	unsigned int bits;
+	int lock_free_reads;
+	// How keys are hashed, from the options
+	hash_function hash_with;
+	uint64_t seed;
+	// What's waiting for readers to finish before it's freed, see epoch.h
+	void * limbo;
+} concurrent_hash;
+
+// Returns a map with room for size objects spread over stripes stripes
+// (rounded up to a power of two), each constructed with the options as in
+// construct_hash_with(). With no grow_at, a stripe can fill up and fail a
+// set() before the map as a whole is full, so a grow_at is a good idea.
+// Stripes never reseed, as keys are hashed before their stripe is picked:
+// a reseed_at only gets every stripe the same random seed (and
+// hash_short_key, without a hash_with). Returns a nullptr if size is
+// negative or stripes isn't positive.
+concurrent_hash * construct_concurrent_hash(int size, int stripes,
+	const hash_options * options);
+
+// A map for read-mostly use, whose get() takes no lock and writes nothing
+// other threads read. set() and delete() still lock their stripe. Stripes
+// always grow, and are their own linear-probing tables rather than hash
+// maps, so there are no options to choose.
+// What delete() returns may still be in use by readers, so free it with
+// concurrent_defer() rather than free(). Likewise, what get() returns is
+// only safe to use until a delete() - unless the get() and its use are
+// between concurrent_enter() and concurrent_exit(), which keeps anything
+// deferred from being freed until after the exit.
+concurrent_hash * construct_concurrent_hash_lock_free(int size, int stripes);
+
+// Frees the map and its data, and runs whatever's still deferred. No other
+// thread may still be using it.
+void free_concurrent_hash(concurrent_hash *);
+
+// set(), get() and delete(), safe to call from any thread
+int concurrent_set(concurrent_hash *, const char * key, void * element);
+void * concurrent_get(concurrent_hash *, const char * key);
+void * concurrent_delete(concurrent_hash *, const char * key);
+
+// Bracket a reader's use of what get() returns, see above. Nestable.
+void concurrent_enter(concurrent_hash *);
+void concurrent_exit(concurrent_hash *);
+
+// Calls fn(datum) once no thread is still between a concurrent_enter() and
+// concurrent_exit() that started before now.
+void concurrent_defer(concurrent_hash *, void * datum, void (*fn)(void *));
+
+// The load factor across all stripes. Stripes are counted one at a time, so
+// with other threads writing it's only a close estimate.
+float concurrent_load(concurrent_hash *);
+
+#endif /* CONCURRENT_H_INCLUDED */
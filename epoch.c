@@ -0,0 +1,211 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Every EPOCH_TRY_EVERY deferrals, a limbo list tries to move the global
+// epoch along and runs whatever is two epochs old.
+#define EPOCH_TRY_EVERY 64
+#define CACHE_LINE 64
+
+// One per thread that has ever read, reused once its thread exits. state is
+// the epoch the thread entered in, shifted up one, with the bottom bit set
+// while it's inside - or 0 when it's outside.
+typedef struct epoch_record
+{
+	_Atomic unsigned long state;
+	atomic_int claimed;
+	int depth;
+	struct epoch_record * next;
+} __attribute__((aligned(CACHE_LINE))) epoch_record;
+
+typedef struct deferred
+{
+	void * ptr;
+	void (*fn)(void *);
+	unsigned long epoch;
+	struct deferred * next;
+} deferred;
+
+struct epoch_limbo
+{
+	pthread_mutex_t lock;
+	deferred * waiting;
+	unsigned long since_try;
+};
+
+static _Atomic unsigned long global_epoch = 1;
+static epoch_record * _Atomic records = 0;
+static __thread epoch_record * own = 0;
+static pthread_key_t own_key;
+static pthread_once_t own_key_once = PTHREAD_ONCE_INIT;
+
+static epoch_record * own_record(void);
+static void release_record(void * record);
+static void make_own_key(void);
+static int try_advance(void);
+
+void epoch_enter(void)
+{
+	epoch_record * record = own_record();
+	if(record->depth++ == 0)
+	{
+		unsigned long epoch = atomic_load(&global_epoch);
+		atomic_store(&record->state, (epoch << 1) | 1);
+		// Whatever we read next has to come after writers can see us
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+}
+
+void epoch_exit(void)
+{
+	epoch_record * record = own;
+	if(--record->depth == 0)
+	{
+		atomic_store_explicit(&record->state, 0, memory_order_release);
+	}
+}
+
+epoch_limbo * construct_epoch_limbo(void)
+{
+	epoch_limbo * limbo = malloc(sizeof(epoch_limbo));
+	pthread_mutex_init(&limbo->lock, 0);
+	limbo->waiting = 0;
+	limbo->since_try = 0;
+	return limbo;
+}
+
+void free_epoch_limbo(epoch_limbo * limbo)
+{
+	// Callbacks may defer more, so keep going until nothing's left
+	while(limbo->waiting != 0)
+	{
+		deferred * item = limbo->waiting;
+		limbo->waiting = item->next;
+		item->fn(item->ptr);
+		free(item);
+	}
+	pthread_mutex_destroy(&limbo->lock);
+	free(limbo);
+}
+
+void epoch_defer(epoch_limbo * limbo, void * ptr, void (*fn)(void *))
+{
+	deferred * item = malloc(sizeof(deferred));
+	item->ptr = ptr;
+	item->fn = fn;
+	// ptr was unlinked before this, so readers entering from here on
+	// can't find it
+	atomic_thread_fence(memory_order_seq_cst);
+	item->epoch = atomic_load(&global_epoch);
+
+	deferred * ready = 0;
+	pthread_mutex_lock(&limbo->lock);
+	item->next = limbo->waiting;
+	limbo->waiting = item;
+	if(++limbo->since_try >= EPOCH_TRY_EVERY)
+	{
+		limbo->since_try = 0;
+		try_advance();
+
+		// Anything deferred two epochs ago can't be seen by any reader
+		// that's still inside, since none of them entered that long ago
+		unsigned long epoch = atomic_load(&global_epoch);
+		deferred ** link = &limbo->waiting;
+		while(*link != 0)
+		{
+			if((*link)->epoch + 2 <= epoch)
+			{
+				deferred * done = *link;
+				*link = done->next;
+				done->next = ready;
+				ready = done;
+			}
+			else
+			{
+				link = &(*link)->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&limbo->lock);
+
+	// Outside the lock, so callbacks can defer more
+	while(ready != 0)
+	{
+		deferred * done = ready;
+		ready = done->next;
+		done->fn(done->ptr);
+		free(done);
+	}
+}
+
+// Moves the global epoch on by one if every reader inside entered in the
+// current one. Returns whether it did.
+static int try_advance(void)
+{
+	unsigned long epoch = atomic_load(&global_epoch);
+	epoch_record * record = atomic_load(&records);
+	for(; record != 0; record = record->next)
+	{
+		unsigned long state = atomic_load(&record->state);
+		if((state & 1) && (state >> 1) != epoch)
+		{
+			return 0;
+		}
+	}
+	return atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+// This thread's record, claiming a free one or adding one the first time
+static epoch_record * own_record(void)
+{
+	if(own != 0)
+	{
+		return own;
+	}
+	pthread_once(&own_key_once, make_own_key);
+
+	epoch_record * record = atomic_load(&records);
+	for(; record != 0; record = record->next)
+	{
+		int unclaimed = 0;
+		if(atomic_compare_exchange_strong(&record->claimed, &unclaimed, 1))
+		{
+			break;
+		}
+	}
+	if(record == 0)
+	{
+		void * memory;
+		if(posix_memalign(&memory, CACHE_LINE, sizeof(epoch_record)))
+		{
+			abort();
+		}
+		record = memory;
+		atomic_init(&record->state, 0);
+		atomic_init(&record->claimed, 1);
+		record->next = atomic_load(&records);
+		while(!atomic_compare_exchange_weak(&records, &record->next, record))
+		{
+		}
+	}
+	record->depth = 0;
+
+	own = record;
+	pthread_setspecific(own_key, record);
+	return record;
+}
+
+// Records are never freed, since try_advance() may be looking at them -
+// exiting threads just give theirs up for the next new thread
+static void release_record(void * record)
+{
+	epoch_record * released = record;
+	atomic_store(&released->state, 0);
+	atomic_store(&released->claimed, 0);
+}
+
+static void make_own_key(void)
+{
+	pthread_key_create(&own_key, release_record);
+}
@@ -0,0 +1,28 @@
+#ifndef EPOCH_H_INCLUDED
+#define EPOCH_H_INCLUDED
+
+// Epoch-based reclamation, for memory that readers may still be looking at
+// without holding a lock. A reader brackets its reads with epoch_enter()
+// and epoch_exit(); a writer that has unlinked something hands it to
+// epoch_defer(), which frees it once every reader that could have seen it
+// has exited. Readers only ever write to their own thread's record, which
+// has a cache line to itself.
+typedef struct epoch_limbo epoch_limbo;
+
+// Nestable - only the outermost enter and exit count
+void epoch_enter(void);
+void epoch_exit(void);
+
+// A list of things waiting to be freed. Every concurrent map has its own,
+// though they all share the one global epoch.
+epoch_limbo * construct_epoch_limbo(void);
+
+// Runs every callback still waiting, whether or not readers are done with
+// them - only call it once nothing can be reading any more.
+void free_epoch_limbo(epoch_limbo *);
+
+// Calls fn(ptr) once no reader that entered before now is still inside.
+// Safe to call from any thread, and from inside fn.
+void epoch_defer(epoch_limbo *, void * ptr, void (*fn)(void *));
+
+#endif /* EPOCH_H_INCLUDED */
@@ -3,23 +3,132 @@
 // from Google's fantastic work on FarmHash):
 // https://github.com/fredrikwidlund/cfarmhash
 #include "cfarmhash.h"
+#include "arena.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "latency.h"
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/random.h>
+#include <time.h>
 
-// hash_cell is the struct for each cell in a map.
-// This struct is not stored in the header to prevent outside access
-// The key for indexing, and the desired data.
-// Status is the enum below, and can either be empty, full, or was_used.
+// cell_table holds the cells of a map, split into one array per field.
+// This struct is not stored in the header to prevent outside access.
+// Cells used to be one {hashed_key, datum, status} struct, which padded out
+// to 24 bytes and dragged every datum pointer into cache while probing. Now
+// a probe reads a one-byte control tag and, on a tag match, an 8-byte hash;
+// data is only touched once the cell has been found.
+// The table and its arrays share one allocation, pointed to by map.
+typedef struct
+{
+	unsigned char * ctrl;
+	uint64_t * hashes;
+	void ** data;
+	struct key_slot * keys;
+} cell_table;
 
-typedef enum {EMPTY, FULL, WAS_USED} cell_status;
+// Each full cell keeps a copy of its key, so two keys with the same 64-bit
+// hash can't be mistaken for each other. Keys are only compared once the
+// tag and hash already match, so they cost nothing on the way past other
+// cells. Keys of up to KEY_INLINE_MAX bytes live right in the slot, with
+// their length in the last byte. Longer ones live in a long_key in the
+// map's arena, and the slot holds a pointer to it and KEY_LONG in the last
+// byte.
+#define KEY_INLINE_MAX 15
+#define KEY_LONG 0xFF
+
+typedef struct key_slot
+{
+	unsigned char bytes[KEY_INLINE_MAX + 1];
+} key_slot;
 
 typedef struct
 {
-	unsigned long hashed_key;
-	void * datum;
-	cell_status status;
-} hash_cell;
+	size_t len;
+	char bytes[];
+} long_key;
+
+#define cells(hash_map) ((cell_table *)(hash_map)->map)
+
+// Control tags stand in for the old cell_status. Every cell gets one byte:
+// empty and was_used cells have the high bit set, and a full cell stores the
+// top 7 bits of its hash. Comparing against the tag finds the few cells
+// worth checking the full hash for.
+#define CTRL_EMPTY 0x80
+#define CTRL_WAS_USED 0xFE
+#define ctrl_tag(h) ((unsigned char)((h) >> 57))
+#define ctrl_full(c) ((c) < 0x80)
+
+// Group width depends on what the compiler lets us use. Without SSE2 we
+// fall back to building the same bitmask one byte at a time.
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GROUP_WIDTH 16
+#else
+#define GROUP_WIDTH 8
+#endif
+
+// Bit i is set if group[i] == tag
+static inline uint32_t group_match(const unsigned char * group,
+	unsigned char tag)
+{
+#if defined(__AVX2__)
+	__m256i g = _mm256_loadu_si256((const __m256i *)group);
+	return (uint32_t)_mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(g, _mm256_set1_epi8((char)tag)));
+#elif defined(__SSE2__)
+	__m128i g = _mm_loadu_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+#else
+	uint32_t mask = 0;
+	int i = 0;
+	for(; i < GROUP_WIDTH; ++i)
+	{
+		mask |= (uint32_t)(group[i] == tag) << i;
+	}
+	return mask;
+#endif
+}
+
+// Bit i is set if group[i] is empty or was_used (high bit set)
+static inline uint32_t group_match_free(const unsigned char * group)
+{
+#if defined(__AVX2__)
+	return (uint32_t)_mm256_movemask_epi8(
+		_mm256_loadu_si256((const __m256i *)group));
+#elif defined(__SSE2__)
+	return (uint32_t)_mm_movemask_epi8(
+		_mm_loadu_si128((const __m128i *)group));
+#else
+	uint32_t mask = 0;
+	int i = 0;
+	for(; i < GROUP_WIDTH; ++i)
+	{
+		mask |= (uint32_t)(group[i] >> 7) << i;
+	}
+	return mask;
+#endif
+}
+
+// Writes a control byte. The first GROUP_WIDTH - 1 tags are mirrored past
+// the end of the array so a group starting near the end can be loaded in
+// one go instead of wrapping. Tiny maps mirror themselves several times.
+static void set_ctrl(hash * hash_map, unsigned long index, unsigned char value)
+{
+	unsigned char * ctrl = cells(hash_map)->ctrl;
+	ctrl[index] = value;
+	for(; index < GROUP_WIDTH - 1; index += hash_map->size)
+	{
+		ctrl[hash_map->size + index] = value;
+	}
+}
 
 // Private hash function from cstring to unsigned long.
 // See function implementation for more detail.
@@ -27,53 +136,183 @@ uint32_t SuperFastHash (const char * data, int len);
 unsigned long ElfHash(const char *s);
 
 
+// Private helpers for the reduction policies in hash.h
+static unsigned long round_size(unsigned long size, hash_reduction reduction);
+static inline unsigned long home_index(hash * hash_map, uint64_t hash_original);
+
+// Cell indices go through ints, so no map gets more cells than this
+#define MAX_CELLS INT_MAX
+
+// Private helpers for stored keys
+static key_slot make_key(arena * keys, const char * key, size_t len);
+static void free_key(arena * keys, key_slot * slot);
+static inline int key_equals(const key_slot * slot, const char * key,
+	size_t len);
+static const char * key_bytes(const key_slot * slot, size_t * len);
+
 // Private function to simplify retrieving a hash in the map
 // Returns the datum's index, or -1.
 // Used get() and delete(), which then implements its own action
-int get_index(hash * hash_map, const char * key, int looking_for_empty);
+int get_index(hash * hash_map, unsigned long hash_original, const char * key,
+	size_t len, int looking_for_empty);
+int get_index_group(hash * hash_map, unsigned long hash_original,
+	const char * key, size_t len, int looking_for_empty);
+int get_index_robin_hood(hash * hash_map, unsigned long hash_original,
+	const char * key, size_t len);
+static int set_hashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original, void * element);
+static void * delete_hashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original);
+static unsigned long place(hash * hash_map, int loc,
+	unsigned long hash_original, key_slot key, void * element);
+static unsigned long set_robin_hood(hash * hash_map,
+	unsigned long hash_original, key_slot key, void * element);
+static void reseed(hash * hash_map);
+static void move_cell(hash * hash_map, unsigned long to, unsigned long from);
+static void remove_at(hash * hash_map, unsigned long index);
+
+// Private helpers for HASH_LATENCY: latency_start() at the top of an
+// operation, then latency_stop() to record its time
+#ifdef HASH_LATENCY
+#define latency_start() uint64_t latency_started = latency_now()
+#define latency_stop(hash_map, op) latency_record( \
+	&((latency_histogram *)(hash_map)->latency)[op], \
+	latency_now() - latency_started)
+#else
+#define latency_start()
+#define latency_stop(hash_map, op)
+#endif
+
+// Private helpers for maps that grow. Growing moves the current cells into
+// a hash struct of their own (hash_map->old) and allocates twice as many;
+// every set(), get() and delete() then moves MIGRATE_STEP more cells across
+// until the old map is empty and can be freed.
+#define MIGRATE_STEP 16
+#define old_map(hash_map) ((hash *)(hash_map)->old)
+static void alloc_cells(hash * hash_map, unsigned long size);
+static void start_growth(hash * hash_map);
+static void migrate_step(hash * hash_map, unsigned long budget);
+
+// Private helper to reclaim was_used cells a few at a time, see purge_step().
+// Purging starts once was_used cells are a quarter of the cells not in use,
+// since what misses pay for is how rare truly empty cells get.
+#define PURGE_RATIO 4
+#define PURGE_STEP 16
+static unsigned long free_cells(hash * hash_map);
+#define needs_purge(hash_map) \
+	((hash_map)->tombstones > free_cells(hash_map) / PURGE_RATIO)
+static void purge_step(hash * hash_map);
+static int purge_swept(hash * hash_map, unsigned long index);
 
 // Return an instance of the class with pre-allocated space for the given 
 // number of objects. If size is negative, returns a nullptr.
 hash * construct_hash(int size)
 {
-	// Check if space is negative - if so, nullptr.
-	if(size < 0)
+	return construct_hash_with(size, 0);
+}
+
+// Same as construct_hash(), with construction options. A null options
+// pointer gives the defaults.
+hash * construct_hash_with(int size, const hash_options * options)
+{
+	// Check if space is negative - if so, nullptr. Likewise if rounding it
+	// for the reduction would take it past MAX_CELLS.
+	if(size < 0 || round_size(size, options ? options->reduction
+		: REDUCE_MODULO) > MAX_CELLS)
 	{
 		return 0;
 	}
 	
 	// Create hash structure
 	hash * new_hash = malloc(sizeof(hash));
+	new_hash->probing = options ? options->probing : PROBE_LINEAR;
+	new_hash->reduction = options ? options->reduction : REDUCE_MODULO;
+	new_hash->reduce_magic = 0;
+	new_hash->grow_at = options ? options->grow_at : 0;
+	// cfarmhash's seed can't break up keys crafted to collide, so maps that
+	// reseed hash with hash_short_key unless told otherwise
+	new_hash->hash_with = options && options->hash_with ? options->hash_with
+		: options && options->reseed_at ? hash_short_key : hash_cfarmhash;
+	new_hash->seed = options ? options->seed : 0;
+	new_hash->reseed_at = options ? options->reseed_at : 0;
+	new_hash->reseed_wait = 0;
+	if(new_hash->reseed_at != 0 && new_hash->seed == 0)
+	{
+		new_hash->seed = hash_random_seed();
+	}
+	new_hash->old = 0;
+	new_hash->migrate_pos = 0;
+	new_hash->in_use = 0;
+	new_hash->tombstones = 0;
+	new_hash->purge_pos = 0;
+	new_hash->purge_run_start = 0;
+	new_hash->purge_run_clean = 0;
+	new_hash->arena = construct_arena();
+	new_hash->wal = 0;
+#ifdef HASH_LATENCY
+	new_hash->latency = calloc(HASH_OP_DELETE + 1, sizeof(latency_histogram));
+#else
+	new_hash->latency = 0;
+#endif
 
 	if(size == 0)
 	{
 		new_hash->map = 0;
-		new_hash->in_use = 0;		
 		new_hash->size = 0;
 		return new_hash;
 	}
 
-	new_hash->in_use = 0;
-	new_hash->size = size;
+	alloc_cells(new_hash, size);
 
-	hash_cell * map = malloc(sizeof(hash_cell) * size);
-	new_hash->map = (void *)map;
+	return new_hash;
+}
 
-	// iterate through the whole map and set initial values
-	int i = 0;
-	for(; i < size; ++i)
+// Allocates empty cells for a map, rounding size for its reduction policy.
+// Doesn't touch whatever cells the map had before.
+static void alloc_cells(hash * hash_map, unsigned long size)
+{
+	hash_map->size = size = round_size(size, hash_map->reduction);
+	hash_map->tombstones = 0;
+	hash_map->purge_pos = 0;
+	hash_map->purge_run_start = 0;
+	hash_map->purge_run_clean = 0;
+	if(hash_map->reduction == REDUCE_POW2)
+	{
+		hash_map->reduce_magic = size - 1;
+	}
+	else if(hash_map->reduction == REDUCE_PRIME)
 	{
-		((hash_cell *)new_hash->map)[i].hashed_key = 0;
-		((hash_cell *)new_hash->map)[i].datum = 0;
-		((hash_cell *)new_hash->map)[i].status = EMPTY;
+		hash_map->reduce_magic = UINT64_C(0xFFFFFFFFFFFFFFFF) / size + 1;
 	}
 
-	return new_hash;
+	// One allocation: table, hashes, data, keys, then size tags plus the
+	// mirrored tail that set_ctrl() maintains. The 8-byte arrays go first
+	// so they stay aligned.
+	cell_table * map = malloc(sizeof(cell_table) + size * sizeof(uint64_t)
+		+ size * sizeof(void *) + size * sizeof(key_slot)
+		+ size + GROUP_WIDTH - 1);
+	map->hashes = (uint64_t *)(map + 1);
+	map->data = (void **)(map->hashes + size);
+	map->keys = (key_slot *)(map->data + size);
+	map->ctrl = (unsigned char *)(map->keys + size);
+	hash_map->map = (void *)map;
+
+	// set initial values for the whole map
+	memset(map->hashes, 0, size * sizeof(uint64_t));
+	memset(map->data, 0, size * sizeof(void *));
+	memset(map->keys, 0, size * sizeof(key_slot));
+	memset(map->ctrl, CTRL_EMPTY, size + GROUP_WIDTH - 1);
 }
 
 // Necessary for manual memory management
 void free_hash(hash * hash_map)
 {
+	if(hash_map->wal != 0)
+	{
+		wal_detach(hash_map);
+	}
+	free(hash_map->latency);
+
 	// free up the map, in reverse order
 	// Memory system keeps track of allocations, and how many bytes each
 	// pointer points to. If there's an allocation at that address, memory 
@@ -81,18 +320,164 @@ void free_hash(hash * hash_map)
 	int i = hash_map->size - 1;
 	for(; i >= 0; --i)
 	{
-		free(((hash_cell *)hash_map->map)[i].datum);
+		free(cells(hash_map)->data[i]);
 	}
 
 	free(hash_map->map);
 	hash_map->map = 0;
 
+	// Long keys all live in the arena, so they go in a few free() calls
+	// rather than one per key. An old map shares its arena with the map
+	// it's moving into, and has none of its own.
+	if(hash_map->arena != 0)
+	{
+		free_arena(hash_map->arena);
+		hash_map->arena = 0;
+	}
+
+	// a map that was still growing has data left in its old cells too
+	if(hash_map->old != 0)
+	{
+		free_hash(old_map(hash_map));
+		hash_map->old = 0;
+	}
+
 	// free up the hash_map struct itself
 
 	free(hash_map);
 	hash_map = 0;
 }
 
+// The hash a map uses for a key. Exposed so callers can hash a key once
+// and hand the result to the *_prehashed() functions.
+uint64_t hash_key(hash * hash_map, const char * key, size_t len)
+{
+	return hash_map->hash_with(key, len, hash_map->seed);
+}
+
+// getrandom() can't fail for 8 bytes once the system has entropy. If it
+// somehow does, the clock and where the stack is make a seed that's at
+// least different from run to run.
+uint64_t hash_random_seed(void)
+{
+	uint64_t seed = 0;
+	if(getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		seed = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec)
+			^ (uint64_t)(uintptr_t)&now;
+		seed = (seed ^ (seed >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+		seed = (seed ^ (seed >> 27)) * UINT64_C(0x94D049BB133111EB);
+		seed ^= seed >> 31;
+	}
+	return seed != 0 ? seed : 1;
+}
+
+// The built-in hash functions, see hash.h
+uint64_t hash_cfarmhash(const char * key, size_t len, uint64_t seed)
+{
+	if(seed == 0)
+	{
+		return cfarmhash(key, len);
+	}
+	return cfarmhash_with_seed(key, len, seed);
+}
+
+// hash_key() for n keys at once, into out. cfarmhash has a batched
+// version of its own, see cfarmhash_many()
+static void hash_keys(hash * hash_map, const char * const * keys,
+	const size_t * lens, size_t n, uint64_t * out)
+{
+	size_t i = 0;
+	if(hash_map->hash_with != hash_cfarmhash)
+	{
+		for(; i < n; i++)
+		{
+			out[i] = hash_key(hash_map, keys[i], lens[i]);
+		}
+	}
+	else if(hash_map->seed == 0)
+	{
+		cfarmhash_many(keys, lens, n, out);
+	}
+	else
+	{
+		cfarmhash_many_with_seed(keys, lens, n, hash_map->seed, out);
+	}
+}
+
+// SuperFastHash's 32 bits are spread over all 64 (the top ones make the
+// control tags) with the finalizer from splitmix64
+uint64_t hash_superfasthash(const char * key, size_t len, uint64_t seed)
+{
+	uint64_t x = SuperFastHash(key, len) ^ seed;
+	x += UINT64_C(0x9E3779B97F4A7C15);
+	x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+// After Wang Yi's wyhash: each step multiplies two 64-bit words into 128
+// bits and folds the halves together
+#define SHORT_KEY_P0 UINT64_C(0xA0761D6478BD642F)
+#define SHORT_KEY_P1 UINT64_C(0xE7037ED1A0B428DB)
+static inline uint64_t fold_multiply(uint64_t a, uint64_t b)
+{
+	unsigned __int128 product = (unsigned __int128)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read_bytes(const char * key, int n)
+{
+	uint64_t value = 0;
+	memcpy(&value, key, n);
+	return value;
+}
+
+uint64_t hash_short_key(const char * key, size_t len, uint64_t seed)
+{
+	uint64_t a, b;
+	seed ^= SHORT_KEY_P0;
+	if(len <= 16)
+	{
+		// Two overlapping reads cover anything from 4 to 16 bytes
+		if(len >= 4)
+		{
+			size_t step = (len >> 3) << 2;
+			a = (read_bytes(key, 4) << 32) | read_bytes(key + step, 4);
+			b = (read_bytes(key + len - 4, 4) << 32)
+				| read_bytes(key + len - 4 - step, 4);
+		}
+		else if(len > 0)
+		{
+			a = ((uint64_t)(unsigned char)key[0] << 16)
+				| ((uint64_t)(unsigned char)key[len >> 1] << 8)
+				| (unsigned char)key[len - 1];
+			b = 0;
+		}
+		else
+		{
+			a = b = 0;
+		}
+	}
+	else
+	{
+		size_t left = len;
+		const char * at = key;
+		for(; left > 16; left -= 16, at += 16)
+		{
+			seed = fold_multiply(read_bytes(at, 8) ^ SHORT_KEY_P1,
+				read_bytes(at + 8, 8) ^ seed);
+		}
+		// The last 16 bytes, overlapping what came before if need be
+		a = read_bytes(key + len - 16, 8);
+		b = read_bytes(key + len - 8, 8);
+	}
+	return fold_multiply(SHORT_KEY_P1 ^ len,
+		fold_multiply(a ^ SHORT_KEY_P1, b ^ seed));
+}
+
 // Couldn't use 'bool', due to no such type existing in C
 // currently debating use of uint8_t, or int, or creating a 'bool' type
 // need to do more research on what is appropriate for C libraries
@@ -101,35 +486,149 @@ void free_hash(hash * hash_map)
 // indicating success / failure of the operation.
 int set(hash * hash_map, const char * key, void * element)
 {
-	// TODO: check if hash is already in map, and return failure
-	// TODO: attempt to simplify by sharing functions with get_index()
+	return set_n(hash_map, key, strlen(key), element);
+}
+
+// set() for a key of len bytes, which may hold anything - including '\0'.
+int set_n(hash * hash_map, const void * key, size_t len, void * element)
+{
+	latency_start();
+	int result = set_prehashed(hash_map, key, len,
+		hash_key(hash_map, key, len), element);
+	latency_stop(hash_map, HASH_OP_SET);
+	return result;
+}
 
-	// if the map is full, don't bother - and report we're full
-	if(hash_map->in_use == hash_map->size)
+// set() for callers that already hold the key's hash_key().
+int set_prehashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original, void * element)
+{
+	int result = set_hashed(hash_map, key, len, hash_original, element);
+	if(result && hash_map->wal != 0)
 	{
-		return 0;
+		wal_append(hash_map->wal, WAL_SET, key, len, element);
 	}
+	return result;
+}
 
-	// Compute hash, modulus the size of the map
-	unsigned long hash_original = cfarmhash(key, strlen(key));
-	//unsigned long hash_original = SuperFastHash(key, strlen(key));
-	
-	int loc = get_index(hash_map, key, 1);
+static int set_hashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original, void * element)
+{
+	if(hash_map->old != 0)
+	{
+		migrate_step(hash_map, MIGRATE_STEP);
+	}
+	if(needs_purge(hash_map))
+	{
+		purge_step(hash_map);
+	}
+
+	// Keys that haven't moved out of the old cells yet are overwritten
+	// where they are, so a key only ever lives in one place
+	if(hash_map->old != 0)
+	{
+		int loc = get_index(old_map(hash_map), hash_original, key, len, 0);
+		if(loc != -1)
+		{
+			cells(old_map(hash_map))->data[loc] = element;
+			return 1;
+		}
+	}
 
-	if(loc != -1)
+	// One pass finds the key if it's here, or else the cell to put it in
+	int loc = get_index(hash_map, hash_original, key, len, 1);
+	if((loc != -1) && ctrl_full(cells(hash_map)->ctrl[loc]))
 	{
-		// are we claiming a new spot or simply overwriting?
-		if(((hash_cell *)hash_map->map)[loc].hashed_key == 0)
-			hash_map->in_use++;
-		((hash_cell *)hash_map->map)[loc].hashed_key = hash_original;
-		((hash_cell *)hash_map->map)[loc].datum = element;		
-		((hash_cell *)hash_map->map)[loc].status = FULL;
+		cells(hash_map)->data[loc] = element;
 		return 1;
 	}
-	else
+
+	// A new key. Grow before it would push the load factor past grow_at,
+	// which means finding a cell for it all over again.
+	if((hash_map->grow_at > 0)
+		&& (hash_map->in_use + 1 > hash_map->grow_at * hash_map->size))
+	{
+		start_growth(hash_map);
+		loc = get_index(hash_map, hash_original, key, len, 1);
+	}
+
+	// if the map is full, don't bother - and report we're full. Robin Hood
+	// doesn't get a cell from get_index(), but a free one always exists.
+	if(free_cells(hash_map) == 0
+		|| (loc == -1 && hash_map->probing != PROBE_ROBIN_HOOD))
 	{
 		return 0;
 	}
+
+	unsigned long probed = place(hash_map, loc, hash_original,
+		make_key(hash_map->arena, key, len), element);
+	if(hash_map->reseed_wait != 0)
+	{
+		hash_map->reseed_wait--;
+	}
+	else if(hash_map->reseed_at != 0 && probed > hash_map->reseed_at)
+	{
+		reseed(hash_map);
+	}
+	return 1;
+}
+
+// Fills a cell with a new entry. loc is the free cell get_index() found for
+// it, except with Robin Hood, which finds its own. Returns how far from home
+// the entry went - with Robin Hood, how far the last entry it pushed along
+// did.
+static unsigned long place(hash * hash_map, int loc,
+	unsigned long hash_original, key_slot key, void * element)
+{
+	hash_map->in_use++;
+	if(hash_map->probing == PROBE_ROBIN_HOOD)
+	{
+		return set_robin_hood(hash_map, hash_original, key, element);
+	}
+
+	if(cells(hash_map)->ctrl[loc] == CTRL_WAS_USED)
+	{
+		hash_map->tombstones--;
+	}
+	cells(hash_map)->hashes[loc] = hash_original;
+	cells(hash_map)->data[loc] = element;
+	cells(hash_map)->keys[loc] = key;
+	set_ctrl(hash_map, loc, ctrl_tag(hash_original));
+	unsigned long home = home_index(hash_map, hash_original);
+	return (unsigned long)loc >= home ? loc - home
+		: loc + hash_map->size - home;
+}
+
+// Rehashes every key under a new random seed, into cells of the same size.
+// Only called once a probe got long, so it's fine for it to take a while.
+static void reseed(hash * hash_map)
+{
+	while(hash_map->old != 0)
+	{
+		migrate_step(hash_map, old_map(hash_map)->size);
+	}
+
+	cell_table * from = cells(hash_map);
+	unsigned long size = hash_map->size;
+	hash_map->seed = hash_random_seed();
+	hash_map->in_use = 0;
+	alloc_cells(hash_map, size);
+
+	// The keys move across without being copied, so stay in the arena
+	unsigned long i = 0;
+	for(; i < size; i++)
+	{
+		if(ctrl_full(from->ctrl[i]))
+		{
+			size_t len;
+			const char * key = key_bytes(&from->keys[i], &len);
+			uint64_t h = hash_key(hash_map, key, len);
+			int loc = get_index(hash_map, h, key, len, 1);
+			place(hash_map, loc, h, from->keys[i], from->data[i]);
+		}
+	}
+	free(from);
+	hash_map->reseed_wait = hash_map->in_use;
 }
 
 // Return the value associated with the given key, or null if no value is set.
@@ -138,117 +637,1602 @@ int set(hash * hash_map, const char * key, void * element)
 // wrapper for the other.
 void * get(hash * hash_map, const char * key)
 {
+	return get_n(hash_map, key, strlen(key));
+}
+
+// get() for a key of len bytes
+void * get_n(hash * hash_map, const void * key, size_t len)
+{
+	latency_start();
+	void * datum = get_prehashed(hash_map, key, len,
+		hash_key(hash_map, key, len));
+	latency_stop(hash_map, HASH_OP_GET);
+	return datum;
+}
+
+// get() for callers that already hold the key's hash_key().
+void * get_prehashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original)
+{
+	if(hash_map->old != 0)
+	{
+		migrate_step(hash_map, MIGRATE_STEP);
+	}
+
 	// Retrieve index of hash, if it exists.
-	int index = get_index(hash_map, key, 0);
-	// send failure condition if not found
-	if(index == -1)
+	int index = get_index(hash_map, hash_original, key, len, 0);
+	if(index != -1)
 	{
-		return 0;
+		return cells(hash_map)->data[index];
 	}
-	// Return pointer to datum
-	else
+	// Not moved over yet?
+	if(hash_map->old != 0)
 	{
-		return ((hash_cell *)hash_map->map)[index].datum;		
+		index = get_index(old_map(hash_map), hash_original, key, len, 0);
+		if(index != -1)
+		{
+			return cells(old_map(hash_map))->data[index];
+		}
 	}
+	// send failure condition if not found
+	return 0;
 }
 
-// Delete the value associated with the given key, returning the value on 
-// success or null if the key has no value.
-void * delete(hash * hash_map, const char * key)
+// Looks up n keys at once, storing each one's get() result in out.
+// A lone get() waits on the cache miss for its first cell before it can do
+// anything else. Here a batch of keys is hashed first and the first cell
+// of each is prefetched, so the misses overlap, and only then are the
+// lookups done. Batches are kept small enough that prefetched lines are
+// still in cache when their lookup comes around.
+#define GET_MANY_BATCH 16
+void get_many(hash * hash_map, const char ** keys, size_t n, void ** out)
 {
-	// Retrieve index of hash, if it exists.
-	int index = get_index(hash_map, key, 0);
-	// Mark out the hash cell, and set to null if it exists
-	if(index > -1)
-	{
-		void * datum = ((hash_cell *)hash_map->map)[index].datum;
-		((hash_cell *)hash_map->map)[index].datum = 0;
-		((hash_cell *)hash_map->map)[index].hashed_key = 0;
-		((hash_cell *)hash_map->map)[index].status = WAS_USED;
-		hash_map->in_use--;
-		return datum;
-	}
-	// if index == -1, return null
-	else
+	size_t lens[GET_MANY_BATCH];
+	uint64_t hashes[GET_MANY_BATCH];
+	size_t start = 0;
+
+	for(; start < n; start += GET_MANY_BATCH)
 	{
-		return 0;
+		size_t count = n - start < GET_MANY_BATCH ? n - start : GET_MANY_BATCH;
+		size_t i = 0;
+		for(; i < count; ++i)
+		{
+			lens[i] = strlen(keys[start + i]);
+		}
+		hash_keys(hash_map, keys + start, lens, count, hashes);
+		for(i = 0; i < count; ++i)
+		{
+			if(hash_map->size != 0)
+			{
+				unsigned long home = home_index(hash_map, hashes[i]);
+				__builtin_prefetch(&cells(hash_map)->ctrl[home]);
+				__builtin_prefetch(&cells(hash_map)->hashes[home]);
+				__builtin_prefetch(&cells(hash_map)->data[home]);
+				// Every hit compares the stored key too
+				__builtin_prefetch(&cells(hash_map)->keys[home]);
+			}
+		}
+		for(i = 0; i < count; ++i)
+		{
+			out[start + i] = get_prehashed(hash_map, keys[start + i],
+				lens[i], hashes[i]);
+		}
 	}
 }
 
-// Return a float value representing the load factor 
-// (\`(items in hash map)/(size of hash map)\`) of the data structure. Since
-// the size of the dat structure is fixed, this should never be greater than 1.
-float load(hash * hash_map)
+// hash_build() splits the cells into one region per thread, and each thread
+// places the keys whose first cell is in its region - walking only cells
+// of that region, so no two threads ever touch the same cell. Keys whose
+// probe runs off the end of their region are set afterwards, on the
+// calling thread. It runs in three rounds of threads: hash the keys and
+// count them per region, sort them by region (keeping them in order within
+// each, so later pairs still win), then place them. Regions smaller than
+// BUILD_MIN_REGION cells aren't worth a thread.
+#define BUILD_MIN_REGION 4096
+
+typedef struct
 {
-	return ((float)hash_map->in_use)/hash_map->size;
-}
+	hash * hash_map;
+	const char ** keys;
+	const size_t * lens;
+	void ** vals;
+	uint64_t * hashes;
+	unsigned int * regions;
+	size_t * order;
+	int threads;
+	// The pairs this thread hashes and sorts, and how many of them go to
+	// each region - then where in order they go
+	size_t begin;
+	size_t end;
+	size_t * counts;
+	// The cells this thread places keys in, and where in order their
+	// pairs are
+	unsigned long cell_begin;
+	unsigned long cell_end;
+	size_t pairs_begin;
+	size_t pairs_end;
+	// Long keys go in an arena of the thread's own until it's finished
+	arena * keys_arena;
+	size_t * overflow;
+	size_t overflowed;
+	unsigned long placed;
+} build_job;
 
-// This function retrieves the index that a hash resides at in a map.
-// Both get(), delete() need an algorithm for this functionality,
-// so it makes sense that both should reference one common location
-// If the hash doesn't exist, it returns -1.
-// Set looking_for_empty if using set(), so that way all three functions
-// reference same collision resolution algorithms
-int get_index(hash * hash_map, const char * key, int looking_for_empty)
+static void run_jobs(build_job * jobs, int threads, void * (*fn)(void *));
+static void * build_hash(void * job);
+static void * build_sort(void * job);
+static void * build_place(void * job);
+
+// set() for n pairs at once, see hash.h
+int hash_build(hash * hash_map, const char ** keys, const size_t * lens,
+	void ** vals, size_t n, int threads)
 {
-	unsigned long hash_original = cfarmhash(key, strlen(key));
+	// An empty map that grows would only grow again and again on the way,
+	// so give it enough cells for everything now
+	if(hash_map->in_use == 0 && hash_map->old == 0 && hash_map->grow_at > 0
+		&& n > hash_map->grow_at * hash_map->size
+		&& round_size(n / hash_map->grow_at + 1, hash_map->reduction)
+			<= MAX_CELLS)
+	{
+		free(hash_map->map);
+		alloc_cells(hash_map, n / hash_map->grow_at + 1);
+	}
 
-	unsigned long hash_mod = hash_original % hash_map->size;
+	if(threads > 1 && hash_map->size / threads < BUILD_MIN_REGION)
+	{
+		threads = hash_map->size / BUILD_MIN_REGION;
+	}
+	if(threads <= 1 || hash_map->probing == PROBE_ROBIN_HOOD
+		|| hash_map->in_use != 0 || hash_map->old != 0
+		|| hash_map->tombstones != 0 || n > hash_map->size
+		|| hash_map->wal != 0)
+	{
+		// Robin Hood moves residents as it goes, and keys already in the
+		// map could be anywhere, so these are set one at a time - as are
+		// pairs that have to be logged
+		int all_set = 1;
+		size_t i = 0;
+		for(; i < n; i++)
+		{
+			all_set &= set_n(hash_map, keys[i], lens[i], vals[i]);
+		}
+		return all_set;
+	}
 
-	hash_cell * map = hash_map->map;
+	uint64_t * hashes = malloc(n * sizeof(uint64_t));
+	unsigned int * regions = malloc(n * sizeof(unsigned int));
+	size_t * order = malloc(n * sizeof(size_t));
+	size_t * counts = calloc((size_t)threads * threads, sizeof(size_t));
+	build_job * jobs = malloc(threads * sizeof(build_job));
+	int t = 0;
+	for(; t < threads; t++)
+	{
+		build_job * job = &jobs[t];
+		job->hash_map = hash_map;
+		job->keys = keys;
+		job->lens = lens;
+		job->vals = vals;
+		job->hashes = hashes;
+		job->regions = regions;
+		job->order = order;
+		job->threads = threads;
+		job->begin = n * t / threads;
+		job->end = n * (t + 1) / threads;
+		job->counts = counts + (size_t)t * threads;
+		// Region r is every cell c with c * threads / size == r
+		job->cell_begin = ((uint64_t)t * hash_map->size + threads - 1)
+			/ threads;
+		job->cell_end = ((uint64_t)(t + 1) * hash_map->size + threads - 1)
+			/ threads;
+	}
 
-	// go through collision resolution until reach empty cell
-	// unless we've explored the whole map...
-	// With linear probing we know we will see every spot in fixed-size map,
-	// in minimum time, which is great with high load factors.
-	// With the original implementation of quadratic probing scheme and 
-	// non-prime-number-sizes we could get stuck in loops where only a small
-	// percentage of the map was being visited. Also had to have O(n) memory
-	// to track when map was fully visited. With linear probing, easy to
-	// establish when whole map is visited (great with high load factors) 
+	run_jobs(jobs, threads, build_hash);
 
-	int num_visited = 0, new_location = hash_mod;
-	while(num_visited != hash_map->size)
+	// Pairs are sorted by region, then by which thread hashed them, so
+	// each region's pairs stay in the order they were given
+	size_t position = 0;
+	int r = 0;
+	for(; r < threads; r++)
 	{
-		new_location = (hash_mod + num_visited) % hash_map->size;
-		// If looking for an empty spot and this is empty
-		// return proper value depending on looking_for_empty
-		if(map[new_location].status == EMPTY)
+		jobs[r].pairs_begin = position;
+		for(t = 0; t < threads; t++)
 		{
-			return looking_for_empty ? new_location : -1;
+			size_t count = jobs[t].counts[r];
+			jobs[t].counts[r] = position;
+			position += count;
 		}
-		// if spot is in-use, use if looking for empty
-		else if((map[new_location].status == WAS_USED) & (looking_for_empty))
+		jobs[r].pairs_end = position;
+	}
+
+	run_jobs(jobs, threads, build_sort);
+	run_jobs(jobs, threads, build_place);
+
+	int all_set = 1;
+	for(t = 0; t < threads; t++)
+	{
+		build_job * job = &jobs[t];
+		hash_map->in_use += job->placed;
+		arena_merge(hash_map->arena, job->keys_arena);
+	}
+	// The pairs that overflowed probed far to begin with, so one of them
+	// may well reseed the map - after which the hashes are stale
+	uint64_t seed = hash_map->seed;
+	for(t = 0; t < threads; t++)
+	{
+		build_job * job = &jobs[t];
+		size_t k = 0;
+		for(; k < job->overflowed; k++)
 		{
-			return new_location;
+			size_t i = job->overflow[k];
+			uint64_t h = hash_map->seed == seed ? hashes[i]
+				: hash_key(hash_map, keys[i], lens[i]);
+			all_set &= set_prehashed(hash_map, keys[i], lens[i], h, vals[i]);
 		}
-		// we want to keep moving for get() and delete()
-		else if((map[new_location].status == FULL)
-			& (map[new_location].hashed_key == hash_original))
-		{
-			// Possible error here - what if hashing algorithm hashes
-			// two keys to same thing? cfarmhash has not yet caused this
-			// to happen, unlike other two hashing algorithms - willing
-			// to risk the probability of this not happening with that
-			// one algorithm for the unimportant and small scale of this
-			// hash map library.
-			return new_location;
+		free(job->overflow);
+	}
+
+	free(jobs);
+	free(counts);
+	free(order);
+	free(regions);
+	free(hashes);
+	return all_set;
+}
+
+// Runs fn on a thread per job - or right here, if a thread can't be had
+static void run_jobs(build_job * jobs, int threads, void * (*fn)(void *))
+{
+	pthread_t * ids = malloc(threads * sizeof(pthread_t));
+	int * started = malloc(threads * sizeof(int));
+	int t = 0;
+	for(; t < threads; t++)
+	{
+		started[t] = pthread_create(&ids[t], 0, fn, &jobs[t]) == 0;
+		if(!started[t])
+		{
+			fn(&jobs[t]);
+		}
+	}
+	for(t = 0; t < threads; t++)
+	{
+		if(started[t])
+		{
+			pthread_join(ids[t], 0);
 		}
+	}
+	free(started);
+	free(ids);
+}
 
-		// otherwise we haven't found what we're looking for
-		num_visited++;
+static void * build_hash(void * arg)
+{
+	build_job * job = arg;
+	hash * hash_map = job->hash_map;
+	hash_keys(hash_map, job->keys + job->begin, job->lens + job->begin,
+		job->end - job->begin, job->hashes + job->begin);
+	size_t i = job->begin;
+	for(; i < job->end; i++)
+	{
+		unsigned int region = (uint64_t)home_index(hash_map, job->hashes[i])
+			* job->threads / hash_map->size;
+		job->regions[i] = region;
+		job->counts[region]++;
+	}
+	return 0;
+}
+
+static void * build_sort(void * arg)
+{
+	build_job * job = arg;
+	size_t i = job->begin;
+	for(; i < job->end; i++)
+	{
+		job->order[job->counts[job->regions[i]]++] = i;
+	}
+	return 0;
+}
+
+static void * build_place(void * arg)
+{
+	build_job * job = arg;
+	hash * hash_map = job->hash_map;
+	cell_table * map = cells(hash_map);
+	job->keys_arena = construct_arena();
+	job->overflow = malloc((job->pairs_end - job->pairs_begin + 1)
+		* sizeof(size_t));
+	job->overflowed = 0;
+	job->placed = 0;
+
+	size_t k = job->pairs_begin;
+	for(; k < job->pairs_end; k++)
+	{
+		size_t i = job->order[k];
+		uint64_t h = job->hashes[i];
+		unsigned char tag = ctrl_tag(h);
+		unsigned long index = home_index(hash_map, h);
+
+		// The map started out empty, so the first empty cell ends the run
+		for(; index < job->cell_end; index++)
+		{
+			if(map->ctrl[index] == CTRL_EMPTY)
+			{
+				map->hashes[index] = h;
+				map->data[index] = job->vals[i];
+				map->keys[index] = make_key(job->keys_arena, job->keys[i],
+					job->lens[i]);
+				set_ctrl(hash_map, index, tag);
+				job->placed++;
+				break;
+			}
+			else if((map->ctrl[index] == tag) && (map->hashes[index] == h)
+				&& key_equals(&map->keys[index], job->keys[i], job->lens[i]))
+			{
+				map->data[index] = job->vals[i];
+				break;
+			}
+		}
+
+		// Ran into the next region, or off the end of the map. Any later
+		// pair with the same key will have too, so they stay in order.
+		if(index == job->cell_end)
+		{
+			job->overflow[job->overflowed++] = i;
+		}
+	}
+	return 0;
+}
+
+// Freezing builds a PTHash-style minimal perfect hash. Keys are split into
+// buckets of about FREEZE_BUCKET_KEYS by their hash, and each bucket gets
+// the first pilot that sends all its keys to entries no other key has
+// taken yet: a key's entry is its hash mixed with its bucket's pilot,
+// reduced to [0, slots). Big buckets go first, while there's the most room.
+// If a bucket runs out of pilots, it starts over with another seed and
+// more buckets.
+// With only as many slots as keys, the last few buckets would need pilot
+// after pilot to hit the last few free slots, so there are a few percent
+// more slots than entries - keys placed in the extra slots are sent to the
+// entries left over through remap. Only those keys read remap at all.
+#define FREEZE_EXTRA_SLOTS 50
+#define FREEZE_BUCKET_KEYS 4
+#define FREEZE_PILOTS 65536
+#define FREEZE_TRIES 8
+
+typedef struct
+{
+	key_slot key;
+	void * datum;
+} frozen_entry;
+
+static inline unsigned long frozen_position(uint64_t h, uint64_t seed,
+	unsigned long pilot, unsigned long size);
+static inline unsigned long frozen_bucket(uint64_t h, uint64_t seed,
+	unsigned long buckets);
+static int find_pilots(uint64_t * hashes, unsigned long n,
+	unsigned long slots, uint64_t seed, unsigned long buckets,
+	uint16_t * pilots, unsigned char * taken);
+static inline unsigned long frozen_entry_of(frozen_hash * frozen,
+	uint64_t h);
+
+frozen_hash * hash_freeze(hash * hash_map)
+{
+	// Finish growing first, so every key is in the one set of cells
+	while(hash_map->old != 0)
+	{
+		migrate_step(hash_map, old_map(hash_map)->size);
+	}
+
+	unsigned long n = hash_map->in_use;
+	uint64_t * hashes = malloc((n + 1) * sizeof(uint64_t));
+	unsigned long * from = malloc((n + 1) * sizeof(unsigned long));
+	unsigned long i = 0, count = 0;
+	for(; i < hash_map->size; i++)
+	{
+		if(ctrl_full(cells(hash_map)->ctrl[i]))
+		{
+			hashes[count] = cells(hash_map)->hashes[i];
+			from[count++] = i;
+		}
+	}
+
+	unsigned long slots = n + n / FREEZE_EXTRA_SLOTS + 1;
+	unsigned long buckets = n / FREEZE_BUCKET_KEYS + 1;
+	unsigned char * taken = malloc(slots);
+	uint16_t * pilots = 0;
+	uint64_t seed = 0;
+	int tries = 0;
+	for(; tries < FREEZE_TRIES; tries++)
+	{
+		pilots = realloc(pilots, buckets * sizeof(uint16_t));
+		if(find_pilots(hashes, n, slots, seed, buckets, pilots, taken))
+		{
+			break;
+		}
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		buckets += buckets / 4;
+	}
+	if(tries == FREEZE_TRIES)
+	{
+		free(taken);
+		free(pilots);
+		free(from);
+		free(hashes);
+		return 0;
+	}
+
+	frozen_hash * frozen = malloc(sizeof(frozen_hash));
+	frozen->size = n;
+	frozen->slots = slots;
+	frozen->buckets = buckets;
+	frozen->seed = seed;
+	frozen->pilots = pilots;
+
+	// Each taken slot past the entries gets the next entry no key took.
+	// Keys that were never in the map can land on the others, so they
+	// point at any entry at all - the key compare turns those away.
+	unsigned long * remap = malloc((slots - n) * sizeof(unsigned long));
+	unsigned long next_free = 0;
+	for(i = n; i < slots; i++)
+	{
+		remap[i - n] = 0;
+		if(taken[i])
+		{
+			while(taken[next_free])
+			{
+				next_free++;
+			}
+			remap[i - n] = next_free++;
+		}
+	}
+	frozen->remap = remap;
+	free(taken);
+
+	frozen_entry * entries = malloc((n + 1) * sizeof(frozen_entry));
+	frozen->entries = entries;
+
+	// Entries and long keys move across as they are - the arena comes too
+	for(i = 0; i < n; i++)
+	{
+		frozen_entry * entry = &entries[frozen_entry_of(frozen, hashes[i])];
+		entry->key = cells(hash_map)->keys[from[i]];
+		entry->datum = cells(hash_map)->data[from[i]];
+	}
+	frozen->arena = hash_map->arena;
+	frozen->hash_with = hash_map->hash_with;
+	frozen->hash_seed = hash_map->seed;
+
+	// Nothing changes a frozen map, so there's nothing more to log
+	if(hash_map->wal != 0)
+	{
+		wal_detach(hash_map);
+	}
+
+	free(hash_map->map);
+	free(hash_map->latency);
+	free(hash_map);
+	free(from);
+	free(hashes);
+	return frozen;
+}
+
+void * frozen_get(frozen_hash * frozen, const char * key)
+{
+	return frozen_get_n(frozen, key, strlen(key));
+}
+
+void * frozen_get_n(frozen_hash * frozen, const void * key, size_t len)
+{
+	if(frozen->size == 0)
+	{
+		return 0;
+	}
+	uint64_t h = frozen->hash_with(key, len, frozen->hash_seed);
+	frozen_entry * entry = &((frozen_entry *)frozen->entries)[
+		frozen_entry_of(frozen, h)];
+	// Keys that were never in the map land on some entry too
+	return key_equals(&entry->key, key, len) ? entry->datum : 0;
+}
+
+void free_frozen_hash(frozen_hash * frozen)
+{
+	frozen_entry * entries = frozen->entries;
+	unsigned long i = 0;
+	for(; i < frozen->size; i++)
+	{
+		free(entries[i].datum);
+	}
+	free_arena(frozen->arena);
+	free(frozen->entries);
+	free(frozen->pilots);
+	free(frozen->remap);
+	free(frozen);
+}
+
+// The entry a key with hash h would be in
+static inline unsigned long frozen_entry_of(frozen_hash * frozen, uint64_t h)
+{
+	unsigned long pilot = ((uint16_t *)frozen->pilots)[
+		frozen_bucket(h, frozen->seed, frozen->buckets)];
+	unsigned long slot = frozen_position(h, frozen->seed, pilot,
+		frozen->slots);
+	return slot < frozen->size ? slot
+		: ((unsigned long *)frozen->remap)[slot - frozen->size];
+}
+
+// Mixes the pilot into the hash, then reduces it the fastrange way
+static inline unsigned long frozen_position(uint64_t h, uint64_t seed,
+	unsigned long pilot, unsigned long size)
+{
+	uint64_t x = h ^ seed ^ (pilot * UINT64_C(0x9E3779B97F4A7C15));
+	x ^= x >> 31;
+	x *= UINT64_C(0xBF58476D1CE4E5B9);
+	x ^= x >> 29;
+	return ((unsigned __int128)x * size) >> 64;
+}
+
+static inline unsigned long frozen_bucket(uint64_t h, uint64_t seed,
+	unsigned long buckets)
+{
+	uint64_t x = (h ^ seed) * UINT64_C(0x94D049BB133111EB);
+	return ((unsigned __int128)x * buckets) >> 64;
+}
+
+// Gives every bucket a pilot, or returns 0 if one of them ran out. taken
+// ends up marking the slots that keys went to.
+static int find_pilots(uint64_t * hashes, unsigned long n,
+	unsigned long slots, uint64_t seed, unsigned long buckets,
+	uint16_t * pilots, unsigned char * taken)
+{
+	// Sort keys by bucket, and buckets by size, biggest first
+	unsigned long * starts = calloc(buckets + 1, sizeof(unsigned long));
+	unsigned long * by_bucket = malloc((n + 1) * sizeof(unsigned long));
+	unsigned long * by_size = malloc(buckets * sizeof(unsigned long));
+	unsigned long i = 0, b = 0;
+	for(; i < n; i++)
+	{
+		starts[frozen_bucket(hashes[i], seed, buckets) + 1]++;
+	}
+	unsigned long largest = 0;
+	for(b = 0; b < buckets; b++)
+	{
+		if(starts[b + 1] > largest)
+		{
+			largest = starts[b + 1];
+		}
+		starts[b + 1] += starts[b];
+	}
+	unsigned long * fill = malloc(buckets * sizeof(unsigned long));
+	memcpy(fill, starts, buckets * sizeof(unsigned long));
+	for(i = 0; i < n; i++)
+	{
+		by_bucket[fill[frozen_bucket(hashes[i], seed, buckets)]++] = i;
+	}
+	unsigned long * size_starts = calloc(largest + 2, sizeof(unsigned long));
+	for(b = 0; b < buckets; b++)
+	{
+		size_starts[largest - (starts[b + 1] - starts[b]) + 1]++;
+	}
+	for(i = 0; i <= largest; i++)
+	{
+		size_starts[i + 1] += size_starts[i];
+	}
+	for(b = 0; b < buckets; b++)
+	{
+		by_size[size_starts[largest - (starts[b + 1] - starts[b])]++] = b;
+	}
+
+	memset(taken, 0, slots);
+	unsigned long * spots = malloc((largest + 1) * sizeof(unsigned long));
+	int found_all = 1;
+	for(i = 0; i < buckets && found_all; i++)
+	{
+		b = by_size[i];
+		unsigned long keys = starts[b + 1] - starts[b];
+		unsigned long pilot = 0;
+		for(; pilot < FREEZE_PILOTS; pilot++)
+		{
+			unsigned long k = 0;
+			for(; k < keys; k++)
+			{
+				spots[k] = frozen_position(hashes[by_bucket[starts[b] + k]],
+					seed, pilot, slots);
+				if(taken[spots[k]])
+				{
+					break;
+				}
+				// Keys of the same bucket can't share an entry either
+				taken[spots[k]] = 1;
+			}
+			if(k == keys)
+			{
+				break;
+			}
+			while(k-- > 0)
+			{
+				taken[spots[k]] = 0;
+			}
+		}
+		pilots[b] = pilot;
+		found_all = pilot < FREEZE_PILOTS;
+	}
+
+	free(spots);
+	free(size_starts);
+	free(fill);
+	free(by_size);
+	free(by_bucket);
+	free(starts);
+	return found_all;
+}
+
+#define align8(offset) (((offset) + 7) & ~(uint64_t)7)
+
+// Writes the map out in the layout snapshot.h describes. The snapshot's
+// cells are laid out afresh - always linearly probed, with a power of two
+// of them at most half full - whatever the map's own probing and size, so
+// mapped_get() only needs the one way to look keys up.
+int hash_save(hash * hash_map, const char * path, size_t value_size)
+{
+	// Every key in the map, in its cells or still in the old ones
+	hash * holders[2] = {hash_map, old_map(hash_map)};
+	uint64_t count = hash_map->in_use;
+	uint64_t slots = 8;
+	while(slots < count * 2 + 1)
+	{
+		slots *= 2;
+	}
+
+	snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	if(hash_map->hash_with == hash_cfarmhash)
+	{
+		header.hash_with = SNAPSHOT_CFARMHASH;
+	}
+	else if(hash_map->hash_with == hash_superfasthash)
+	{
+		header.hash_with = SNAPSHOT_SUPERFASTHASH;
+	}
+	else if(hash_map->hash_with == hash_short_key)
+	{
+		header.hash_with = SNAPSHOT_SHORT_KEY;
+	}
+	else
+	{
+		return 0;
+	}
+	header.hash_seed = hash_map->seed;
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(header);
+	header.count = count;
+	header.slots = slots;
+	header.value_size = value_size;
+
+	unsigned char * ctrl = malloc(slots);
+	snapshot_cell * snapshot_cells = calloc(slots, sizeof(snapshot_cell));
+	memset(ctrl, SNAPSHOT_EMPTY, slots);
+	uint64_t keys_size = 0, saved = 0;
+	int holder = 0;
+	for(; holder < 2 && holders[holder] != 0; holder++)
+	{
+		hash * from = holders[holder];
+		unsigned long i = 0;
+		for(; i < from->size; i++)
+		{
+			if(!ctrl_full(cells(from)->ctrl[i]))
+			{
+				continue;
+			}
+			uint64_t h = cells(from)->hashes[i];
+			uint64_t index = h & (slots - 1);
+			while(ctrl[index] != SNAPSHOT_EMPTY)
+			{
+				index = (index + 1) & (slots - 1);
+			}
+			size_t len;
+			key_bytes(&cells(from)->keys[i], &len);
+			ctrl[index] = ctrl_tag(h);
+			snapshot_cells[index].hashed_key = h;
+			snapshot_cells[index].key_offset = keys_size;
+			snapshot_cells[index].key_len = len;
+			snapshot_cells[index].value_offset = saved++ * value_size;
+			keys_size += len;
+		}
+	}
+
+	header.ctrl_offset = align8(sizeof(header));
+	header.cells_offset = align8(header.ctrl_offset + slots);
+	header.keys_offset = header.cells_offset + slots * sizeof(snapshot_cell);
+	header.values_offset = align8(header.keys_offset + keys_size);
+	header.file_size = header.values_offset + count * value_size;
+
+	// Written beside path, then renamed over it
+	size_t path_len = strlen(path);
+	char * temporary = malloc(path_len + 5);
+	memcpy(temporary, path, path_len);
+	memcpy(temporary + path_len, ".tmp", 5);
+	FILE * file = fopen(temporary, "wb");
+	int written = file != 0;
+	static const char padding[8];
+	if(written)
+	{
+		written &= fwrite(&header, sizeof(header), 1, file) == 1;
+		written &= fwrite(padding, header.ctrl_offset - sizeof(header), 1,
+			file) <= 1;
+		written &= fwrite(ctrl, slots, 1, file) == 1;
+		written &= fwrite(padding, header.cells_offset - header.ctrl_offset
+			- slots, 1, file) <= 1;
+		written &= fwrite(snapshot_cells, sizeof(snapshot_cell), slots, file)
+			== slots;
+
+		// Keys and values go in the order they were numbered above
+		for(holder = 0; holder < 2 && holders[holder] != 0; holder++)
+		{
+			hash * from = holders[holder];
+			unsigned long i = 0;
+			for(; i < from->size; i++)
+			{
+				if(ctrl_full(cells(from)->ctrl[i]))
+				{
+					size_t len;
+					const char * key = key_bytes(&cells(from)->keys[i], &len);
+					written &= fwrite(key, 1, len, file) == len;
+				}
+			}
+		}
+		written &= fwrite(padding, header.values_offset - header.keys_offset
+			- keys_size, 1, file) <= 1;
+		// A null datum is saved as zeroes, as the WAL logs it
+		char * zeroes = calloc(1, value_size + 1);
+		for(holder = 0; holder < 2 && holders[holder] != 0; holder++)
+		{
+			hash * from = holders[holder];
+			unsigned long i = 0;
+			for(; i < from->size && value_size != 0; i++)
+			{
+				if(ctrl_full(cells(from)->ctrl[i]))
+				{
+					void * datum = cells(from)->data[i];
+					written &= fwrite(datum != 0 ? datum : zeroes, value_size,
+						1, file) == 1;
+				}
+			}
+		}
+		free(zeroes);
+		written &= fclose(file) == 0;
+		written = written && rename(temporary, path) == 0;
+		if(!written)
+		{
+			remove(temporary);
+		}
+	}
+
+	free(temporary);
+	free(snapshot_cells);
+	free(ctrl);
+	return written;
+}
+
+// Delete the value associated with the given key, returning the value on 
+// success or null if the key has no value.
+void * delete(hash * hash_map, const char * key)
+{
+	return delete_n(hash_map, key, strlen(key));
+}
+
+// delete() for a key of len bytes
+void * delete_n(hash * hash_map, const void * key, size_t len)
+{
+	latency_start();
+	void * datum = delete_prehashed(hash_map, key, len,
+		hash_key(hash_map, key, len));
+	latency_stop(hash_map, HASH_OP_DELETE);
+	return datum;
+}
+
+// delete() for callers that already hold the key's hash_key().
+void * delete_prehashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original)
+{
+	void * datum = delete_hashed(hash_map, key, len, hash_original);
+	if(datum != 0 && hash_map->wal != 0)
+	{
+		wal_append(hash_map->wal, WAL_DELETE, key, len, 0);
+	}
+	return datum;
+}
+
+static void * delete_hashed(hash * hash_map, const char * key, size_t len,
+	uint64_t hash_original)
+{
+	if(hash_map->old != 0)
+	{
+		migrate_step(hash_map, MIGRATE_STEP);
+	}
+	if(needs_purge(hash_map))
+	{
+		purge_step(hash_map);
+	}
+
+	// Retrieve index of hash, if it exists, in whichever cells hold it.
+	hash * holder = hash_map;
+	int index = get_index(hash_map, hash_original, key, len, 0);
+	if(index == -1 && hash_map->old != 0)
+	{
+		holder = old_map(hash_map);
+		index = get_index(holder, hash_original, key, len, 0);
+	}
+	// Mark out the hash cell, and set to null if it exists
+	if(index > -1)
+	{
+		void * datum = cells(holder)->data[index];
+		free_key(hash_map->arena, &cells(holder)->keys[index]);
+		remove_at(holder, index);
+		// in_use of a growing map counts the old cells' entries too
+		if(holder != hash_map)
+		{
+			holder->in_use--;
+		}
+		hash_map->in_use--;
+		return datum;
+	}
+	// if index == -1, return null
+	else
+	{
+		return 0;
+	}
+}
+
+// Return a float value representing the load factor 
+// (\`(items in hash map)/(size of hash map)\`) of the data structure. Since
+// the size of the dat structure is fixed, this should never be greater than 1.
+float load(hash * hash_map)
+{
+	return ((float)hash_map->in_use)/hash_map->size;
+}
+
+// Which hash_statistics bucket a count goes in
+static inline unsigned int stats_bucket(unsigned long value)
+{
+	unsigned int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+	return bucket < HASH_STATS_BUCKETS ? bucket : HASH_STATS_BUCKETS - 1;
+}
+
+// See hash.h
+void hash_stats(hash * hash_map, hash_statistics * stats)
+{
+	memset(stats, 0, sizeof(hash_statistics));
+	stats->unmoved = hash_map->old != 0 ? old_map(hash_map)->in_use : 0;
+	unsigned long size = hash_map->size;
+	if(size == 0)
+	{
+		return;
+	}
+	cell_table * map = cells(hash_map);
+
+	// Hits, and who's what
+	double hit_total = 0;
+	unsigned long i = 0, first_empty = size;
+	for(; i < size; i++)
+	{
+		if(map->ctrl[i] == CTRL_EMPTY)
+		{
+			stats->empty++;
+			if(first_empty == size)
+			{
+				first_empty = i;
+			}
+			continue;
+		}
+		if(map->ctrl[i] == CTRL_WAS_USED)
+		{
+			stats->tombstones++;
+			continue;
+		}
+		stats->entries++;
+		unsigned long home = home_index(hash_map, map->hashes[i]);
+		unsigned long displaced = i >= home ? i - home : i + size - home;
+		stats->displacements[stats_bucket(displaced)]++;
+		hit_total += displaced + 1;
+		if(displaced + 1 > stats->max_hit_probe)
+		{
+			stats->max_hit_probe = displaced + 1;
+		}
+	}
+	if(stats->entries != 0)
+	{
+		stats->mean_hit_probe = hit_total / stats->entries;
+	}
+
+	// With no empty cell, every miss goes all the way round
+	if(first_empty == size)
+	{
+		stats->mean_miss_probe = stats->max_miss_probe = size;
+		stats->runs = 1;
+		stats->max_run = size;
+		stats->run_lengths[stats_bucket(size)]++;
+		return;
+	}
+
+	// Misses and runs, walking backwards round from an empty cell: each
+	// cell is one further from the next empty cell than the one after it
+	double miss_total = 0;
+	unsigned long to_empty = 0, step = 0;
+	for(i = first_empty; step < size; step++)
+	{
+		if(map->ctrl[i] == CTRL_EMPTY)
+		{
+			if(to_empty != 0)
+			{
+				stats->runs++;
+				stats->run_lengths[stats_bucket(to_empty)]++;
+				if(to_empty > stats->max_run)
+				{
+					stats->max_run = to_empty;
+				}
+			}
+			to_empty = 0;
+		}
+		else
+		{
+			to_empty++;
+		}
+		miss_total += to_empty + 1;
+		if(to_empty + 1 > stats->max_miss_probe)
+		{
+			stats->max_miss_probe = to_empty + 1;
+		}
+		i = i == 0 ? size - 1 : i - 1;
+	}
+	// The run just before first_empty, if there is one
+	if(to_empty != 0)
+	{
+		stats->runs++;
+		stats->run_lengths[stats_bucket(to_empty)]++;
+		if(to_empty > stats->max_run)
+		{
+			stats->max_run = to_empty;
+		}
+	}
+	stats->mean_miss_probe = miss_total / size;
+}
+
+// Times kept with HASH_LATENCY, see hash.h
+int hash_latency_report(hash * hash_map, hash_operation op,
+	hash_latency * report)
+{
+	if(hash_map->latency == 0)
+	{
+		return 0;
+	}
+	const latency_histogram * histogram =
+		&((latency_histogram *)hash_map->latency)[op];
+	report->count = histogram->count;
+	report->p50 = latency_percentile(histogram, 0.5);
+	report->p99 = latency_percentile(histogram, 0.99);
+	report->p999 = latency_percentile(histogram, 0.999);
+	report->max = latency_ns(histogram->max);
+	return 1;
+}
+
+void hash_latency_reset(hash * hash_map)
+{
+	if(hash_map->latency != 0)
+	{
+		memset(hash_map->latency, 0,
+			(HASH_OP_DELETE + 1) * sizeof(latency_histogram));
+	}
+}
+
+// This function retrieves the index that a hash resides at in a map.
+// Both get(), delete() need an algorithm for this functionality,
+// so it makes sense that both should reference one common location
+// If the hash doesn't exist, it returns -1.
+// Set looking_for_empty if using set(), so that way all three functions
+// reference same collision resolution algorithms: then it returns the key's
+// cell if it's there, or else the first free cell on its probe path (-1 if
+// there are none). The key can be past a was_used cell, so finding a free
+// cell doesn't end the search - only an empty one does.
+int get_index(hash * hash_map, unsigned long hash_original, const char * key,
+	size_t len, int looking_for_empty)
+{
+	// A map of size 0 has nowhere to look
+	if(hash_map->size == 0)
+	{
+		return -1;
+	}
+
+	if(hash_map->probing == PROBE_GROUP)
+	{
+		return get_index_group(hash_map, hash_original, key, len,
+			looking_for_empty);
+	}
+	else if(hash_map->probing == PROBE_ROBIN_HOOD)
+	{
+		// set() only needs to know if the key is there - Robin Hood
+		// finds its own cell in set_robin_hood()
+		return get_index_robin_hood(hash_map, hash_original, key, len);
+	}
+
+	unsigned long hash_mod = home_index(hash_map, hash_original);
+
+	unsigned char * ctrl = cells(hash_map)->ctrl;
+	uint64_t * hashes = cells(hash_map)->hashes;
+	key_slot * keys = cells(hash_map)->keys;
+	unsigned char tag = ctrl_tag(hash_original);
+	int first_free = -1;
+
+	// go through collision resolution until reach empty cell
+	// unless we've explored the whole map...
+	// With linear probing we know we will see every spot in fixed-size map,
+	// in minimum time, which is great with high load factors.
+	// With the original implementation of quadratic probing scheme and 
+	// non-prime-number-sizes we could get stuck in loops where only a small
+	// percentage of the map was being visited. Also had to have O(n) memory
+	// to track when map was fully visited. With linear probing, easy to
+	// establish when whole map is visited (great with high load factors) 
+
+	// Step forward and wrap instead of taking the modulus every step
+	int num_visited = 0, new_location = hash_mod;
+	while(num_visited != hash_map->size)
+	{
+		// If looking for an empty spot and this is empty
+		// return proper value depending on looking_for_empty
+		if(ctrl[new_location] == CTRL_EMPTY)
+		{
+			if(!looking_for_empty)
+			{
+				return -1;
+			}
+			return first_free != -1 ? first_free : new_location;
+		}
+		// if spot is in-use, remember it if looking for empty
+		else if(ctrl[new_location] == CTRL_WAS_USED)
+		{
+			if(looking_for_empty && first_free == -1)
+			{
+				first_free = new_location;
+			}
+		}
+		// we want to keep moving for get() and delete()
+		// The tag is checked first, so the hash is only read for cells
+		// that are full and have a 1-in-128 chance of matching, and the
+		// key only when the whole hash matches too. Keys are compared
+		// because two keys can hash to the same thing - unlikely with
+		// cfarmhash, but it used to silently return the wrong value.
+		else if((ctrl[new_location] == tag)
+			&& (hashes[new_location] == hash_original)
+			&& key_equals(&keys[new_location], key, len))
+		{
+			return new_location;
+		}
+
+		// otherwise we haven't found what we're looking for
+		num_visited++;
+		if(++new_location == hash_map->size)
+		{
+			new_location = 0;
+		}
+	}
+	// Couldn't find the hash's location
+	return first_free;
+}
+
+// PROBE_GROUP version of get_index(). Walks the same linear probe sequence,
+// but a group of control tags at a time: one compare finds the cells whose
+// tag matches, another finds where the run ends. Only tag matches that come
+// before the end of the run need their hash checked, so misses usually
+// never touch the cells at all. For set(), a third compare finds the first
+// free cell along the way.
+int get_index_group(hash * hash_map, unsigned long hash_original,
+	const char * key, size_t len, int looking_for_empty)
+{
+	uint64_t * hashes = cells(hash_map)->hashes;
+	key_slot * keys = cells(hash_map)->keys;
+	unsigned char tag = ctrl_tag(hash_original);
+	unsigned long pos = home_index(hash_map, hash_original);
+	unsigned long remaining = hash_map->size;
+	int first_free = -1;
+
+	while(remaining != 0)
+	{
+		// Don't look at more cells than are left to visit - small maps
+		// would otherwise see their mirrored tail twice.
+		unsigned long width = remaining < GROUP_WIDTH ?
+			remaining : GROUP_WIDTH;
+		uint32_t limit = width == 32 ? 0xFFFFFFFFu : (1u << width) - 1;
+		const unsigned char * group = cells(hash_map)->ctrl + pos;
+
+		uint32_t stops = group_match(group, CTRL_EMPTY) & limit;
+		uint32_t matches = group_match(group, tag) & limit;
+		if(stops)
+		{
+			// only matches before the first stop are on the probe path
+			matches &= (stops & -stops) - 1;
+		}
+		if(looking_for_empty && first_free == -1)
+		{
+			// was_used or empty, and empty cells end the run anyway
+			uint32_t free = group_match_free(group) & limit;
+			if(free)
+			{
+				first_free = pos + __builtin_ctz(free);
+				if(first_free >= hash_map->size)
+				{
+					first_free -= hash_map->size;
+				}
+			}
+		}
+
+		while(matches)
+		{
+			unsigned long index = pos + __builtin_ctz(matches);
+			if(index >= hash_map->size)
+			{
+				index -= hash_map->size;
+			}
+			if((hashes[index] == hash_original)
+				&& key_equals(&keys[index], key, len))
+			{
+				return index;
+			}
+			matches &= matches - 1;
+		}
+
+		if(stops)
+		{
+			return first_free;
+		}
+
+		pos += width;
+		if(pos >= hash_map->size)
+		{
+			pos -= hash_map->size;
+		}
+		remaining -= width;
+	}
+	// Visited the whole map
+	return first_free;
+}
+
+// Starts growing a map to twice its size. The current cells become the old
+// map, which has to be empty before it can be replaced again - so if the
+// last growth hasn't finished moving, it's finished here in one go.
+static void start_growth(hash * hash_map)
+{
+	while(hash_map->old != 0)
+	{
+		migrate_step(hash_map, old_map(hash_map)->size);
+	}
+
+	unsigned long size = round_size(hash_map->size < 4 ? 8
+		: hash_map->size * 2, hash_map->reduction);
+	if(size > MAX_CELLS)
+	{
+		// As big as it gets: from now on it's a fixed-size map, whose
+		// set() fails once it's full
+		hash_map->grow_at = 0;
+		return;
+	}
+	if(hash_map->map != 0)
+	{
+		hash * old = malloc(sizeof(hash));
+		*old = *hash_map;
+		old->grow_at = 0;
+		old->old = 0;
+		// keys move across without being copied, so stay in our arena
+		old->arena = 0;
+		// and the log and times stay ours too
+		old->wal = 0;
+		old->latency = 0;
+		hash_map->old = old;
+		hash_map->migrate_pos = 0;
+	}
+	alloc_cells(hash_map, size);
+}
+
+// Moves up to budget of the old map's cells into hash_map's cells, and
+// frees the old map once all of them have moved.
+static void migrate_step(hash * hash_map, unsigned long budget)
+{
+	hash * old = old_map(hash_map);
+	cell_table * from = cells(old);
+
+	for(; budget != 0 && hash_map->migrate_pos < old->size; --budget)
+	{
+		unsigned long index = hash_map->migrate_pos;
+		if(ctrl_full(from->ctrl[index]))
+		{
+			// The key isn't in the new cells, so this finds a free one
+			size_t len;
+			const char * key = key_bytes(&from->keys[index], &len);
+			int loc = get_index(hash_map, from->hashes[index], key, len, 1);
+			place(hash_map, loc, from->hashes[index], from->keys[index],
+				from->data[index]);
+			remove_at(old, index);
+			old->in_use--;
+			// the entry was already counted in hash_map->in_use
+			hash_map->in_use--;
+			// Robin Hood may have shifted the next resident into this
+			// cell, so look at it again
+			if(old->probing == PROBE_ROBIN_HOOD)
+			{
+				continue;
+			}
+		}
+		hash_map->migrate_pos++;
+	}
+
+	if(hash_map->migrate_pos == old->size)
+	{
+		// Nothing left in the old cells, so don't free any data
+		free(old->map);
+		free(old);
+		hash_map->old = 0;
+	}
+}
+
+// How far the resident of a full cell sits from the cell it hashes to
+static inline unsigned long displacement(hash * hash_map, unsigned long index)
+{
+	unsigned long home = home_index(hash_map, cells(hash_map)->hashes[index]);
+	return index >= home ? index - home : index + hash_map->size - home;
+}
+
+// PROBE_ROBIN_HOOD lookup. Residents of a run are kept ordered so none is
+// further from home than the one after it, which means a miss can stop at
+// an empty cell or at the first resident that is closer to its home than
+// we are to ours - the key would have displaced it on the way in.
+int get_index_robin_hood(hash * hash_map, unsigned long hash_original,
+	const char * key, size_t len)
+{
+	unsigned char * ctrl = cells(hash_map)->ctrl;
+	uint64_t * hashes = cells(hash_map)->hashes;
+	key_slot * keys = cells(hash_map)->keys;
+	unsigned char tag = ctrl_tag(hash_original);
+	unsigned long index = home_index(hash_map, hash_original);
+	unsigned long distance = 0;
+
+	for(; distance != hash_map->size; ++distance)
+	{
+		if(ctrl[index] == CTRL_EMPTY
+			|| displacement(hash_map, index) < distance)
+		{
+			return -1;
+		}
+		else if((ctrl[index] == tag) && (hashes[index] == hash_original)
+			&& key_equals(&keys[index], key, len))
+		{
+			return index;
+		}
+
+		if(++index == hash_map->size)
+		{
+			index = 0;
+		}
 	}
-	// Couldn't find the hash's location
 	return -1;
 }
 
+// PROBE_ROBIN_HOOD insertion of a key that isn't in the map yet. Walks the
+// run carrying the new cell and swaps it with any resident closer to its
+// home than the carried cell is to its own. The evicted resident is
+// carried on until an empty cell takes it. Returns how far from home the
+// last carried cell ends up.
+static unsigned long set_robin_hood(hash * hash_map,
+	unsigned long hash_original, key_slot key, void * element)
+{
+	cell_table * map = cells(hash_map);
+	uint64_t carried_hash = hash_original;
+	void * carried_datum = element;
+	key_slot carried_key = key;
+	unsigned long index = home_index(hash_map, hash_original);
+	unsigned long distance = 0;
+
+	while(ctrl_full(map->ctrl[index]))
+	{
+		unsigned long resident = displacement(hash_map, index);
+		if(resident < distance)
+		{
+			uint64_t swap_hash = map->hashes[index];
+			void * swap_datum = map->data[index];
+			key_slot swap_key = map->keys[index];
+			map->hashes[index] = carried_hash;
+			map->data[index] = carried_datum;
+			map->keys[index] = carried_key;
+			set_ctrl(hash_map, index, ctrl_tag(carried_hash));
+			carried_hash = swap_hash;
+			carried_datum = swap_datum;
+			carried_key = swap_key;
+			distance = resident;
+		}
+
+		distance++;
+		if(++index == hash_map->size)
+		{
+			index = 0;
+		}
+	}
+
+	map->hashes[index] = carried_hash;
+	map->data[index] = carried_datum;
+	map->keys[index] = carried_key;
+	set_ctrl(hash_map, index, ctrl_tag(carried_hash));
+	return distance;
+}
+
+// Moves a full cell's entry into another cell, leaving the old one as is
+static void move_cell(hash * hash_map, unsigned long to, unsigned long from)
+{
+	cell_table * map = cells(hash_map);
+	map->hashes[to] = map->hashes[from];
+	map->data[to] = map->data[from];
+	map->keys[to] = map->keys[from];
+	set_ctrl(hash_map, to, map->ctrl[from]);
+}
+
+// Empties a full cell, whose key has been freed or moved elsewhere.
+// Linear and group probing leave a was_used cell so
+// later keys in the run stay reachable. Robin Hood instead shifts the rest
+// of the run back one cell, until it reaches an empty cell or a resident
+// already in its home cell, so no was_used cells are ever left behind.
+static void remove_at(hash * hash_map, unsigned long index)
+{
+	cell_table * map = cells(hash_map);
+
+	if(hash_map->probing != PROBE_ROBIN_HOOD)
+	{
+		map->data[index] = 0;
+		map->hashes[index] = 0;
+		set_ctrl(hash_map, index, CTRL_WAS_USED);
+		hash_map->tombstones++;
+		if(purge_swept(hash_map, index))
+		{
+			hash_map->purge_run_clean = 0;
+		}
+		return;
+	}
+
+	// A full map could in principle be one run with nobody home, so never
+	// shift more than the other size - 1 cells
+	unsigned long next = index + 1 == hash_map->size ? 0 : index + 1;
+	unsigned long shifted = 0;
+	while(ctrl_full(map->ctrl[next]) && displacement(hash_map, next) != 0
+		&& ++shifted < hash_map->size)
+	{
+		move_cell(hash_map, index, next);
+		index = next;
+		next = index + 1 == hash_map->size ? 0 : index + 1;
+	}
+	map->data[index] = 0;
+	map->hashes[index] = 0;
+	set_ctrl(hash_map, index, CTRL_EMPTY);
+}
+
+// Sweeps cells from purge_pos, reclaiming was_used cells so misses don't
+// drift toward full-table scans as deletes pile up:
+// - A full cell moves back to the first was_used cell on its own probe path,
+//   if there is one. Lookups simply find it sooner, and the was_used cell
+//   moves to where the entry was - along with the sweep.
+// - At an empty cell (the end of a run), if the sweep has covered the whole
+//   run since its start, every was_used cell left in the run goes: each
+//   resident after it was swept and would have moved into it if it were on
+//   the resident's path. A delete() behind the sweep in the same run breaks
+//   that, and then only the was_used cells right before the empty one go.
+// A map with no empty cells left has no run ends, so the only thing that
+// helps there is the map emptying out - then every was_used cell can go.
+// Each delete() can leave one was_used cell, so a sweep has to get round
+// the map well before that many deletes fill the free cells: the budget is
+// PURGE_STEP cells scaled by size / free cells (16 at half load, 320 at 0.95),
+// and emptying a run counts against it too.
+static void purge_step(hash * hash_map)
+{
+	cell_table * map = cells(hash_map);
+	unsigned long size = hash_map->size;
+	unsigned long in_cells = size - free_cells(hash_map);
+	long budget = PURGE_STEP * size / free_cells(hash_map);
+
+	for(; budget > 0; --budget)
+	{
+		unsigned long index = hash_map->purge_pos;
+		if(++hash_map->purge_pos == size)
+		{
+			hash_map->purge_pos = 0;
+		}
+
+		if(ctrl_full(map->ctrl[index]))
+		{
+			unsigned long spot = home_index(hash_map, map->hashes[index]);
+			while(spot != index && ctrl_full(map->ctrl[spot]))
+			{
+				if(++spot == size)
+				{
+					spot = 0;
+				}
+			}
+			if(spot != index)
+			{
+				move_cell(hash_map, spot, index);
+				map->hashes[index] = 0;
+				map->data[index] = 0;
+				set_ctrl(hash_map, index, CTRL_WAS_USED);
+			}
+		}
+		else if((map->ctrl[index] == CTRL_WAS_USED) && (in_cells == 0))
+		{
+			set_ctrl(hash_map, index, CTRL_EMPTY);
+			hash_map->tombstones--;
+		}
+		else if(map->ctrl[index] == CTRL_EMPTY)
+		{
+			// Walk back over the run, or just its was_used tail
+			unsigned long back = index;
+			while(back != hash_map->purge_run_start)
+			{
+				back = back == 0 ? size - 1 : back - 1;
+				if(map->ctrl[back] == CTRL_WAS_USED)
+				{
+					set_ctrl(hash_map, back, CTRL_EMPTY);
+					hash_map->tombstones--;
+				}
+				else if(!hash_map->purge_run_clean)
+				{
+					break;
+				}
+				--budget;
+			}
+			// The next run starts here, and the sweep will see all of it
+			hash_map->purge_run_start = hash_map->purge_pos;
+			hash_map->purge_run_clean = 1;
+		}
+	}
+}
+
+// Whether a cell is in the part of the current run purge_step() has swept
+static int purge_swept(hash * hash_map, unsigned long index)
+{
+	unsigned long start = hash_map->purge_run_start;
+	unsigned long end = hash_map->purge_pos;
+	if(start <= end)
+	{
+		return (index >= start) && (index < end);
+	}
+	return (index >= start) || (index < end);
+}
+
+// Copies a key into a key slot - in place if it fits, otherwise into a
+// long_key from the arena
+static key_slot make_key(arena * keys, const char * key, size_t len)
+{
+	key_slot slot;
+	memset(&slot, 0, sizeof(slot));
+	if(len <= KEY_INLINE_MAX)
+	{
+		memcpy(slot.bytes, key, len);
+		slot.bytes[KEY_INLINE_MAX] = len;
+	}
+	else
+	{
+		long_key * stored = arena_alloc(keys, sizeof(long_key) + len);
+		stored->len = len;
+		memcpy(stored->bytes, key, len);
+		memcpy(slot.bytes, &stored, sizeof(stored));
+		slot.bytes[KEY_INLINE_MAX] = KEY_LONG;
+	}
+	return slot;
+}
+
+// Hands back whatever make_key() took from the arena for a slot
+static void free_key(arena * keys, key_slot * slot)
+{
+	if(slot->bytes[KEY_INLINE_MAX] == KEY_LONG)
+	{
+		long_key * stored;
+		memcpy(&stored, slot->bytes, sizeof(stored));
+		arena_free(keys, stored, sizeof(long_key) + stored->len);
+	}
+	memset(slot, 0, sizeof(*slot));
+}
+
+// The key a slot holds, and its length
+static const char * key_bytes(const key_slot * slot, size_t * len)
+{
+	if(slot->bytes[KEY_INLINE_MAX] == KEY_LONG)
+	{
+		long_key * stored;
+		memcpy(&stored, slot->bytes, sizeof(stored));
+		*len = stored->len;
+		return stored->bytes;
+	}
+	*len = slot->bytes[KEY_INLINE_MAX];
+	return (const char *)slot->bytes;
+}
+
+static inline int key_equals(const key_slot * slot, const char * key,
+	size_t len)
+{
+	size_t stored_len;
+	const char * stored = key_bytes(slot, &stored_len);
+	return (stored_len == len) && (memcmp(stored, key, len) == 0);
+}
+
+// Cells of hash_map's own that aren't full - empty and was_used alike
+static unsigned long free_cells(hash * hash_map)
+{
+	unsigned long in_cells = hash_map->in_use;
+	if(hash_map->old != 0)
+	{
+		in_cells -= old_map(hash_map)->in_use;
+	}
+	return hash_map->size - in_cells;
+}
+
+// Sizes each reduction policy can work with: powers of two for masking and
+// primes for REDUCE_PRIME, rounding up from the size asked for.
+static unsigned long round_size(unsigned long size, hash_reduction reduction)
+{
+	if(reduction == REDUCE_POW2)
+	{
+		unsigned long rounded = 1;
+		while(rounded < size)
+		{
+			rounded <<= 1;
+		}
+		return rounded;
+	}
+	else if(reduction == REDUCE_PRIME)
+	{
+		// Trial division is plenty - it only runs once per map
+		unsigned long candidate = size < 2 ? 2 : size;
+		while(1)
+		{
+			unsigned long divisor = 2;
+			for(; divisor * divisor <= candidate; ++divisor)
+			{
+				if(candidate % divisor == 0)
+				{
+					break;
+				}
+			}
+			if(divisor * divisor > candidate)
+			{
+				return candidate;
+			}
+			candidate++;
+		}
+	}
+	return size;
+}
+
+// The first cell a hash probes. Sizes are below 2^32, so fast range and the
+// prime reciprocal work on the low 32 bits of the hash, which also keeps
+// them independent of the high bits used for control tags.
+// See https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+// and https://lemire.me/blog/2019/02/08/faster-remainders-when-the-divisor-is-a-constant-beating-compilers-and-libdivide/
+static inline unsigned long home_index(hash * hash_map, uint64_t hash_original)
+{
+	uint32_t low = (uint32_t)hash_original;
+	switch(hash_map->reduction)
+	{
+		case REDUCE_POW2:
+			return hash_original & hash_map->reduce_magic;
+		case REDUCE_FASTRANGE:
+			return ((uint64_t)low * hash_map->size) >> 32;
+		case REDUCE_PRIME:
+			return ((unsigned __int128)(hash_map->reduce_magic * low)
+				* hash_map->size) >> 64;
+		default:
+			return hash_original % hash_map->size;
+	}
+}
+
 // This function should not be used by consumers.
 // In C++ and other object-oriented languages, it would be marked private
 // and the testing classes would be a 'friend' (C++ keyword) of this one
 // private function. Not sure how to implement that in C.
 void * retrieveLocation(hash * hash_map, int loc)
 {
-	return ((hash_cell * )(hash_map->map))[loc].datum;
+	return cells(hash_map)->data[loc];
 }
 
 // Different hash algorithm then ELFHash. After seeing very similar hashes 
@@ -260,7 +2244,7 @@ void * retrieveLocation(hash * hash_map, int loc)
 // inputs, unlike ELFHash. I should probaby look into a different probing
 // structure still, though
 
-/*#undef get16bits
+#undef get16bits
 #if (defined(__GNUC__) && defined(__i386__)) || defined(__WATCOMC__) \
   || defined(_MSC_VER) || defined (__BORLANDC__) || defined (__TURBOC__)
 #define get16bits(d) (*((const uint16_t *) (d)))
@@ -320,6 +2304,8 @@ int rem;
 // of the PJW hash. This is conventionally used for ELF files in Unix systems.
 // This algorithm was chosen for its simplicity, and that it sees common use.
 // See https://en.wikipedia.org/wiki/PJW_hash_function
+// Maps don't use it any more, it's only here so ./quality can compare it.
+// It stops at the first '\0'.
 unsigned long ElfHash(const char *s)
 {
 	unsigned long h = 0, high;
@@ -332,4 +2318,3 @@ unsigned long ElfHash(const char *s)
 	h &= ~high;
 	return h;
 }
-*/
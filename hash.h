@@ -4,17 +4,127 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+// Collision resolution schemes a map can be constructed with.
+// Every cell has a one-byte control tag (empty, was_used, or 7 bits of the
+// cell's hash) kept apart from the cells' hashes and data.
+// PROBE_LINEAR walks the tags one at a time (the original behavior).
+// PROBE_GROUP compares a whole group of tags (16 with SSE2, 32 with AVX2)
+// per step. It visits cells in the same order as PROBE_LINEAR, so keys land
+// in the same cells either way - it's only faster to walk long probe runs.
+// PROBE_ROBIN_HOOD lets set() displace residents that sit closer to their
+// first cell than the new key would, and has delete() shift the rest of the
+// run back instead of leaving was_used cells behind. Probe lengths stay
+// short and even, and a miss can stop as soon as it has probed further
+// than the resident it's looking at.
+typedef enum {PROBE_LINEAR, PROBE_GROUP, PROBE_ROBIN_HOOD} hash_probing;
+
+// How a hash is reduced to the cell it probes first. Only the first cell
+// costs a reduction - probing after that steps forward and wraps.
+// REDUCE_MODULO uses hash % size on the size asked for (the original).
+// REDUCE_POW2 rounds the size up to a power of two and masks the hash.
+// REDUCE_FASTRANGE keeps the size asked for and maps the hash onto it with
+// a multiply and shift (Lemire's fast range) instead of a divide.
+// REDUCE_PRIME rounds the size up to a prime, like Java's maps, and takes
+// the modulus with a precomputed reciprocal instead of a divide.
+// Rounded sizes show up in hash->size, and load() uses them.
+typedef enum {REDUCE_MODULO, REDUCE_POW2, REDUCE_FASTRANGE, REDUCE_PRIME}
+	hash_reduction;
+
+// A hash function a map can be constructed with: hashes len bytes of key,
+// mixing in seed. Three come built in, below - or bring your own.
+typedef uint64_t (*hash_function)(const char * key, size_t len,
+	uint64_t seed);
+
+// cfarmhash, the default. Good at every length. Seed 0 gives exactly
+// cfarmhash(), and other seeds are mixed into its result, the way
+// FarmHash's own Hash64WithSeed() does it.
+uint64_t hash_cfarmhash(const char * key, size_t len, uint64_t seed);
+// SuperFastHash, mixed out to 64 bits. Its hashes only have 32 bits in
+// them, so different keys share a hash more often - which costs a key
+// compare, not a wrong answer.
+uint64_t hash_superfasthash(const char * key, size_t len, uint64_t seed);
+// A wyhash-style hash built for short keys such as IDs: keys of up to 16
+// bytes take a couple of loads and two multiplies. Longer keys work too,
+// at 16 bytes and one multiply a step.
+uint64_t hash_short_key(const char * key, size_t len, uint64_t seed);
+
+// Construction options. A zeroed struct gives the same map construct_hash()
+// does, so callers only need to fill in what they care about.
+typedef struct
+{
+	hash_probing probing;
+	hash_reduction reduction;
+	// Load factor at which set() grows the map to twice its size, e.g. 0.75.
+	// Zero keeps the map fixed-size, where set() fails once it's full.
+	// Entries move to the new cells a few at a time on each later set(),
+	// get() and delete() rather than all at once. Maps stop growing short
+	// of INT_MAX cells, and are fixed-size from then on.
+	float grow_at;
+	// The hash function and its seed. Null means hash_cfarmhash, or
+	// hash_short_key with a reseed_at.
+	hash_function hash_with;
+	uint64_t seed;
+	// For maps keyed by strings someone else picks: when a set() has to
+	// probe more than reseed_at cells to place a new key, every key is
+	// rehashed under a new random seed (at most once per in_use new keys,
+	// so it stays cheap). A seed of 0 is replaced by a random one too.
+	// Zero never reseeds. A reseed changes every key's hash_key(), so don't
+	// mix this with the *_prehashed() functions. hash_short_key mixes its
+	// seed in from the start, where hash_cfarmhash only mixes it into the
+	// unseeded hash - keys crafted to share all 64 bits of cfarmhash() keep
+	// sharing them under any seed. So with no hash_with, a reseed_at picks
+	// hash_short_key.
+	unsigned long reseed_at;
+} hash_options;
+
 typedef struct
 {
 	void * map;
+	// Where keys too long to keep in their cell are stored, see arena.h
+	void * arena;
 	unsigned long in_use;
 	unsigned long size;	
+	hash_probing probing;
+	hash_reduction reduction;
+	// Mask for REDUCE_POW2, reciprocal for REDUCE_PRIME
+	uint64_t reduce_magic;
+	float grow_at;
+	hash_function hash_with;
+	uint64_t seed;
+	// See hash_options, and new keys to go before another reseed is allowed
+	unsigned long reseed_at;
+	unsigned long reseed_wait;
+	// While growing, the map being moved out of (its own hash struct) and
+	// the next of its cells to move. in_use counts entries in both.
+	void * old;
+	unsigned long migrate_pos;
+	// was_used cells left by delete(). Once they pass a quarter of the
+	// cells not in use, every set() and delete() also sweeps a few cells
+	// from purge_pos, moving entries back toward home and emptying
+	// was_used cells that nothing probes past.
+	unsigned long tombstones;
+	unsigned long purge_pos;
+	// Where the run purge_pos is in started, and whether the sweep has seen
+	// all of it without a delete() behind it
+	unsigned long purge_run_start;
+	int purge_run_clean;
+	// The write-ahead log set() and delete() append to, if one is attached
+	// (see wal.h)
+	void * wal;
+	// With HASH_LATENCY, a latency_histogram for each hash_operation (see
+	// latency.h); otherwise a nullptr
+	void * latency;
 } hash;
 
 // Return an instance of the class with pre-allocated space for the given 
 // number of objects.
 hash * construct_hash(int size);
 
+// Same as construct_hash(), with the options above. Passing a null options
+// pointer is the same as passing a zeroed struct. Returns a nullptr if the
+// reduction would round size past INT_MAX.
+hash * construct_hash_with(int size, const hash_options * options);
+
 // Necessary for manual memory management - the 'destructor' equivalent for
 // this hash map pseudo-class.
 void free_hash(hash *);
@@ -33,16 +143,146 @@ int set(hash *, const char *, void *);
 // the other.
 void * get(hash *, const char *);
 
+// get() for n keys at once, with out[i] set to get(keys[i]). Overlaps the
+// cache misses of different keys, which a string of get() calls can't -
+// worthwhile when the map is much bigger than the CPU's cache.
+void get_many(hash *, const char ** keys, size_t n, void ** out);
+
+// set_n() for n pairs at once: keys[i], of lens[i] bytes, set to vals[i].
+// Later pairs win for keys given more than once. Into an empty map that
+// isn't Robin Hood, the keys are hashed and placed on up to threads
+// threads at once, without locks; otherwise it's n set_n() calls. An empty
+// map with a grow_at is given enough cells for all n first. Returns 0 if
+// any pair couldn't be set, like set().
+int hash_build(hash *, const char ** keys, const size_t * lens, void ** vals,
+	size_t n, int threads);
+
 // Delete the value associated with the given key, returning the value on 
 // success or null if the key has no value.
 void * delete(hash *, const char *);
 
 
+// set(), get() and delete() for keys that aren't C strings: the key is len
+// bytes long and may hold any bytes, '\0' included (packed IDs, UUIDs...).
+// Also saves a strlen() when the caller already knows the length.
+int set_n(hash *, const void * key, size_t len, void *);
+void * get_n(hash *, const void * key, size_t len);
+void * delete_n(hash *, const void * key, size_t len);
+
+// The hash a map uses for a key of len bytes. Hash a key once with this and
+// pass the result to the *_prehashed() functions below to skip rehashing it,
+// e.g. when looking the same key up in several maps that hash the same way.
+uint64_t hash_key(hash *, const char * key, size_t len);
+
+// A seed from the system's random source, for hash_options.seed. Never 0.
+uint64_t hash_random_seed(void);
+
+// Which of 2^bits parts a key with hash_key() h belongs to, for splitting
+// keys between maps. Uses the bits just below the top 7, which every map
+// keeps in its cells' control tags - if the parts were picked by those,
+// the keys in each would have tags that barely differ.
+#define hash_partition(h, bits) \
+	(((h) >> (57 - (bits))) & ((UINT64_C(1) << (bits)) - 1))
+
+// set(), get() and delete() for a key whose hash_key() the caller already
+// has. key and len must be what h was computed from.
+int set_prehashed(hash *, const char * key, size_t len, uint64_t h, void *);
+void * get_prehashed(hash *, const char * key, size_t len, uint64_t h);
+void * delete_prehashed(hash *, const char * key, size_t len, uint64_t h);
+
 // Return a float value representing the load factor 
 // (\`(items in hash map)/(size of hash map)\`) of the data structure. Since
 // the size of the dat structure is fixed, this should never be greater than 1.
+// Growing maps stay at or below their grow_at load factor.
 float load(hash *);
 
+// What a scan of a map's cells finds, from hash_stats(). Probe lengths
+// count cells looked at: a hit looks at every cell from its key's home to
+// the key, and a miss from a home at every cell up to the next empty one
+// (an upper bound with Robin Hood, whose misses can stop sooner), averaged
+// over every home. A run is cells in a row that aren't empty - full or
+// was_used. Histogram bucket 0 counts zeros, and bucket b counts values
+// from 2^(b-1) to 2^b - 1; the last bucket takes anything bigger.
+#define HASH_STATS_BUCKETS 32
+typedef struct
+{
+	unsigned long entries;
+	unsigned long tombstones;
+	unsigned long empty;
+	// Entries of a growing map still in its old cells, which the rest of
+	// these don't cover
+	unsigned long unmoved;
+	double mean_hit_probe;
+	unsigned long max_hit_probe;
+	double mean_miss_probe;
+	unsigned long max_miss_probe;
+	unsigned long runs;
+	unsigned long max_run;
+	unsigned long run_lengths[HASH_STATS_BUCKETS];
+	// How far entries sit from their home cells
+	unsigned long displacements[HASH_STATS_BUCKETS];
+} hash_statistics;
+
+// Scans every cell of the map into stats. Takes a pass over the cells, so
+// it's for sampling now and then - e.g. to decide when a map needs
+// rebuilding or resizing - not for every operation.
+void hash_stats(hash *, hash_statistics * stats);
+
+// Built with HASH_LATENCY defined (make HASH_LATENCY=1), every set(), get()
+// and delete() - and their _n() forms - times itself, hashing included,
+// into a histogram of its map's. The *_prehashed() functions aren't timed,
+// so neither are concurrent and sharded maps, which use them.
+typedef enum {HASH_OP_SET, HASH_OP_GET, HASH_OP_DELETE} hash_operation;
+
+// Percentiles of an operation's times, in nanoseconds. Each is rounded up
+// by at most an eighth, except max, which is exact (to the clock).
+typedef struct
+{
+	uint64_t count;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} hash_latency;
+
+// Fills in report for op's times since the map was made or last reset.
+// Returns 0 if the map wasn't built to keep times.
+int hash_latency_report(hash *, hash_operation op, hash_latency * report);
+void hash_latency_reset(hash *);
+
+// A map frozen by hash_freeze(): no more set() or delete(), but get() is
+// exactly one hash, one entry read and one key compare. Keys are placed by
+// a minimal perfect hash - every key has an entry of its own, and there's
+// an entry for every key, so no probing and no empty cells. On top of the
+// entries, it takes a 16-bit pilot for every few keys, and a remap for 2%
+// of them.
+typedef struct
+{
+	void * entries;
+	void * pilots;
+	void * remap;
+	void * arena;
+	// How the map it was frozen from hashed keys
+	hash_function hash_with;
+	uint64_t hash_seed;
+	unsigned long size;
+	unsigned long slots;
+	unsigned long buckets;
+	uint64_t seed;
+} frozen_hash;
+
+// Moves every entry of a map into a frozen_hash and frees the map. Returns
+// a nullptr and leaves the map as it was if no perfect hash turned up -
+// which only happens when two keys have the same 64-bit hash.
+frozen_hash * hash_freeze(hash *);
+
+// get() and get_n() on a frozen map
+void * frozen_get(frozen_hash *, const char * key);
+void * frozen_get_n(frozen_hash *, const void * key, size_t len);
+
+// Frees the frozen map and its data, like free_hash()
+void free_frozen_hash(frozen_hash *);
+
 int keyCollision(hash *, const char *);
 
 uint32_t SuperFastHash (const char * data, int len);
@@ -0,0 +1,97 @@
+#include "latency.h"
+#include <pthread.h>
+#include <time.h>
+
+// Times below LATENCY_STEPS get a bucket each. Above that, a time's bucket
+// is its highest set bit, then the LATENCY_STEPS values of the bits below.
+#define STEP_BITS 3
+
+static unsigned int bucket_of(uint64_t ticks)
+{
+	if(ticks < LATENCY_STEPS)
+	{
+		return ticks;
+	}
+	unsigned int high = 63 - __builtin_clzll(ticks);
+	return (high - STEP_BITS + 1) * LATENCY_STEPS
+		+ ((ticks >> (high - STEP_BITS)) & (LATENCY_STEPS - 1));
+}
+
+// The largest time that lands in a bucket
+static uint64_t bucket_top(unsigned int bucket)
+{
+	if(bucket < LATENCY_STEPS)
+	{
+		return bucket;
+	}
+	unsigned int high = bucket / LATENCY_STEPS + STEP_BITS - 1;
+	uint64_t step = bucket % LATENCY_STEPS;
+	uint64_t bottom = ((uint64_t)LATENCY_STEPS + step) << (high - STEP_BITS);
+	return bottom + (UINT64_C(1) << (high - STEP_BITS)) - 1;
+}
+
+void latency_record(latency_histogram * histogram, uint64_t ticks)
+{
+	histogram->counts[bucket_of(ticks)]++;
+	histogram->count++;
+	if(ticks > histogram->max)
+	{
+		histogram->max = ticks;
+	}
+}
+
+uint64_t latency_percentile(const latency_histogram * histogram,
+	double fraction)
+{
+	if(histogram->count == 0)
+	{
+		return 0;
+	}
+	// The rank-th smallest time, counting from 1
+	uint64_t rank = fraction * histogram->count;
+	if(rank < fraction * histogram->count || rank == 0)
+	{
+		rank++;
+	}
+	uint64_t seen = 0;
+	unsigned int bucket = 0;
+	for(; bucket < LATENCY_BUCKETS; bucket++)
+	{
+		seen += histogram->counts[bucket];
+		if(seen >= rank)
+		{
+			uint64_t top = bucket_top(bucket);
+			return latency_ns(top < histogram->max ? top : histogram->max);
+		}
+	}
+	return latency_ns(histogram->max);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static double ns_per_tick;
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+
+static void calibrate(void)
+{
+	struct timespec start, end, wait = {0, 10000000};
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t ticks = latency_now();
+	nanosleep(&wait, 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ticks = latency_now() - ticks;
+	double ns = (end.tv_sec - start.tv_sec) * 1e9
+		+ (end.tv_nsec - start.tv_nsec);
+	ns_per_tick = ticks != 0 ? ns / ticks : 1;
+}
+
+uint64_t latency_ns(uint64_t ticks)
+{
+	pthread_once(&calibrated, calibrate);
+	return ticks * ns_per_tick;
+}
+#else
+uint64_t latency_ns(uint64_t ticks)
+{
+	return ticks;
+}
+#endif
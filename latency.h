@@ -0,0 +1,50 @@
+#ifndef LATENCY_H_INCLUDED
+#define LATENCY_H_INCLUDED
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Log-bucketed latency histograms, for maps built with HASH_LATENCY (see
+// hash_latency_report() in hash.h). Times are kept in ticks of
+// latency_now(), and each power of two of ticks is split into
+// LATENCY_STEPS buckets - so a percentile read back is at most 1/8th over
+// the real one, and recording a time is a few shifts and an add.
+#define LATENCY_STEPS 8
+#define LATENCY_BUCKETS (64 * LATENCY_STEPS)
+
+typedef struct
+{
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t max;
+} latency_histogram;
+
+// The time stamp counter on x86, which is cheaper to read than the clock
+// (and ticks at a constant rate on anything recent); nanoseconds elsewhere
+static inline uint64_t latency_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void latency_record(latency_histogram *, uint64_t ticks);
+
+// The time, in nanoseconds, that fraction (0 to 1) of the recorded times
+// are at or below - rounded up to the top of its bucket, but never past the
+// largest time recorded. 0 if nothing was recorded.
+uint64_t latency_percentile(const latency_histogram *, double fraction);
+
+// Ticks of latency_now() in nanoseconds. On x86 the first call spends 10ms
+// timing the counter against the clock.
+uint64_t latency_ns(uint64_t ticks);
+
+#endif /* LATENCY_H_INCLUDED */
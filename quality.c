@@ -0,0 +1,468 @@
+#include "hash.h"
+#include "cfarmhash.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Measures how good and how fast the hash functions are, so one can be
+// picked for a workload on numbers rather than anecdotes: speed per key
+// length, avalanche and bit independence on random keys, how evenly
+// realistic key sets spread over buckets, and the probe lengths those
+// keys get in real maps (from hash_stats()).
+
+const static char * help = "Compares hash functions: speed, avalanche, bit "\
+	"independence, bucket chi-square and probe lengths in real maps.\n";
+const static char * help_flags = "FLAGS:\n"\
+	"\t-n keys:\tKeys per key set (default 100000).\n"\
+	"\t-f hash:\tOnly cfarmhash, superfasthash, elfhash, sfh-mixed or short.\n"\
+	"\t-h:\tDisplays this message.\n";
+
+// Not in hash.h: hash.c keeps them for comparison, and maps use
+// hash_superfasthash(), which mixes SuperFastHash out to 64 bits
+uint32_t SuperFastHash(const char * data, int len);
+unsigned long ElfHash(const char * s);
+
+// The functions as hash_function, unseeded. ElfHash stops at the first
+// '\0', so it's only ever given keys that end with one.
+static uint64_t raw_cfarmhash(const char * key, size_t len, uint64_t seed)
+{
+	return cfarmhash(key, len);
+}
+
+static uint64_t raw_superfasthash(const char * key, size_t len,
+	uint64_t seed)
+{
+	return SuperFastHash(key, len);
+}
+
+static uint64_t raw_elfhash(const char * key, size_t len, uint64_t seed)
+{
+	return ElfHash(key);
+}
+
+typedef struct
+{
+	const char * name;
+	hash_function function;
+	// How many low bits the function fills
+	int bits;
+} candidate;
+
+static const candidate candidates[] = {
+	{"cfarmhash", raw_cfarmhash, 64},
+	{"superfasthash", raw_superfasthash, 32},
+	{"elfhash", raw_elfhash, 64},
+	{"sfh-mixed", hash_superfasthash, 64},
+	{"short", hash_short_key, 64},
+};
+#define CANDIDATES (sizeof(candidates) / sizeof(candidates[0]))
+
+// splitmix64, so every run sees the same keys
+static uint64_t next_random(uint64_t * state)
+{
+	uint64_t x = (*state += UINT64_C(0x9E3779B97F4A7C15));
+	x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+	return x ^ (x >> 31);
+}
+
+// Random bytes then a '\0'. No byte is '\0' or a single bit, so flipping
+// any one bit can't make a '\0' that ElfHash would stop at.
+static void random_key(char * key, size_t len, uint64_t * state)
+{
+	size_t i = 0;
+	for(; i < len; i++)
+	{
+		unsigned char byte;
+		do
+		{
+			byte = next_random(state);
+		}
+		while((byte & (byte - 1)) == 0);
+		key[i] = byte;
+	}
+	key[len] = '\0';
+}
+
+// Cycles where there's a cycle counter, nanoseconds elsewhere
+static uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static void speed(const candidate * c)
+{
+	static const size_t lens[] = {4, 8, 16, 32, 64, 256, 1024};
+	enum { KEYS = 64, ROUNDS = 2000 };
+	char * keys = malloc(KEYS * 1025);
+	uint64_t state = 1;
+	printf("%-14s", c->name);
+	unsigned int l = 0;
+	for(; l < sizeof(lens) / sizeof(lens[0]); l++)
+	{
+		size_t len = lens[l];
+		int k = 0;
+		for(; k < KEYS; k++)
+		{
+			random_key(keys + k * 1025, len, &state);
+		}
+		// Best of a few, so an interruption doesn't count
+		double best = 0;
+		int trial = 0;
+		uint64_t sink = 0;
+		for(; trial < 5; trial++)
+		{
+			int rounds = ROUNDS * 16 / (len + 16);
+			uint64_t start = ticks();
+			int r = 0;
+			for(; r < rounds; r++)
+			{
+				for(k = 0; k < KEYS; k++)
+				{
+					sink += c->function(keys + k * 1025, len, 0);
+				}
+			}
+			double per_key = (double)(ticks() - start) / (rounds * KEYS);
+			if(trial == 0 || per_key < best)
+			{
+				best = per_key;
+			}
+		}
+		printf(" %8.2f", sink == 1 ? 0 : len / best);
+	}
+	printf("\n");
+	free(keys);
+}
+
+// Flips every bit of random keys of len bytes. Avalanche is how far from
+// one half the chance of each output bit flipping gets; bit independence
+// is how correlated the flips of two output bits get, for the same input
+// bit. Both are reported as their worst case over all bits, 0 best.
+static void avalanche(const candidate * c, size_t len, int samples)
+{
+	int in_bits = len * 8, out = c->bits;
+	uint64_t * flips = calloc(in_bits * 64, sizeof(uint64_t));
+	// Pairs of output bits flipping together, for every input bit
+	uint32_t * pairs = calloc((size_t)in_bits * 64 * 64, sizeof(uint32_t));
+	char key[64];
+	uint64_t state = 2;
+	int s = 0;
+	for(; s < samples; s++)
+	{
+		random_key(key, len, &state);
+		uint64_t h = c->function(key, len, 0);
+		int i = 0;
+		for(; i < in_bits; i++)
+		{
+			key[i / 8] ^= 1 << (i % 8);
+			uint64_t d = h ^ c->function(key, len, 0);
+			key[i / 8] ^= 1 << (i % 8);
+			uint64_t * f = &flips[i * 64];
+			uint32_t * p = &pairs[(size_t)i * 64 * 64];
+			uint64_t bits = d;
+			while(bits)
+			{
+				int j = __builtin_ctzll(bits);
+				bits &= bits - 1;
+				f[j]++;
+				uint64_t later = bits;
+				while(later)
+				{
+					p[j * 64 + __builtin_ctzll(later)]++;
+					later &= later - 1;
+				}
+			}
+		}
+	}
+
+	double worst_bias = 0, total_bias = 0, worst_correlation = 0;
+	int i = 0;
+	for(; i < in_bits; i++)
+	{
+		int j = 0;
+		for(; j < out; j++)
+		{
+			double p = (double)flips[i * 64 + j] / samples;
+			double bias = fabs(2 * p - 1);
+			total_bias += bias;
+			if(bias > worst_bias)
+			{
+				worst_bias = bias;
+			}
+			int k = j + 1;
+			for(; k < out; k++)
+			{
+				double q = (double)flips[i * 64 + k] / samples;
+				double both = (double)pairs[((size_t)i * 64 + j) * 64 + k]
+					/ samples;
+				double spread = sqrt(p * (1 - p) * q * (1 - q));
+				double correlation = spread > 0
+					? fabs(both - p * q) / spread : 1;
+				if(correlation > worst_correlation)
+				{
+					worst_correlation = correlation;
+				}
+			}
+		}
+	}
+	printf("%-14s %4zu %10.3f %10.3f %10.3f\n", c->name, len,
+		total_bias / (in_bits * out), worst_bias, worst_correlation);
+	free(flips);
+	free(pairs);
+}
+
+typedef struct
+{
+	const char * name;
+	char * bytes;
+	const char ** keys;
+	size_t * lens;
+	size_t count;
+} key_set;
+
+// Test%d keys like the unit tests use, URLs, and random UUIDs
+static key_set make_keys(const char * name, size_t count)
+{
+	key_set set;
+	set.name = name;
+	set.count = count;
+	set.bytes = malloc(count * 64);
+	set.keys = malloc(count * sizeof(char *));
+	set.lens = malloc(count * sizeof(size_t));
+	uint64_t state = 3;
+	size_t i = 0;
+	for(; i < count; i++)
+	{
+		char * key = set.bytes + i * 64;
+		if(strcmp(name, "test") == 0)
+		{
+			set.lens[i] = sprintf(key, "Test%zu", i);
+		}
+		else if(strcmp(name, "url") == 0)
+		{
+			set.lens[i] = sprintf(key, "https://example.com/user/%zu/posts",
+				i);
+		}
+		else
+		{
+			uint64_t high = next_random(&state), low = next_random(&state);
+			set.lens[i] = sprintf(key, "%08x-%04x-4%03x-%04x-%012llx",
+				(unsigned int)(high >> 32), (unsigned int)(high >> 16) & 0xFFFF,
+				(unsigned int)high & 0xFFF,
+				0x8000 | ((unsigned int)(low >> 48) & 0x3FFF),
+				(unsigned long long)low & UINT64_C(0xFFFFFFFFFFFF));
+		}
+		set.keys[i] = key;
+	}
+	return set;
+}
+
+static void free_keys(key_set * set)
+{
+	free(set->bytes);
+	free(set->keys);
+	free(set->lens);
+}
+
+// Chi-square of keys over buckets picked by the low bits, as a z-score:
+// 0 is as even as random, and a few either way is noise
+static double chi_square(const candidate * c, const key_set * set,
+	int bucket_bits)
+{
+	size_t buckets = (size_t)1 << bucket_bits;
+	unsigned int * counts = calloc(buckets, sizeof(unsigned int));
+	size_t i = 0;
+	for(; i < set->count; i++)
+	{
+		counts[c->function(set->keys[i], set->lens[i], 0) & (buckets - 1)]++;
+	}
+	double expected = (double)set->count / buckets, chi = 0;
+	for(i = 0; i < buckets; i++)
+	{
+		chi += (counts[i] - expected) * (counts[i] - expected) / expected;
+	}
+	free(counts);
+	return (chi - (buckets - 1)) / sqrt(2.0 * (buckets - 1));
+}
+
+// Fills a fixed-size linearly probed map to 3/4 with keys from a set and
+// reports its mean and max probe lengths. pow2 maps get the largest power
+// of two the keys fill, which rounding would otherwise make bigger.
+static void probes(const candidate * c, const key_set * set,
+	hash_reduction reduction)
+{
+	hash_options options = {PROBE_LINEAR, reduction, 0, c->function};
+	unsigned long size = set->count * 4 / 3;
+	if(reduction == REDUCE_POW2)
+	{
+		while(size & (size - 1))
+		{
+			size &= size - 1;
+		}
+	}
+	hash * map = construct_hash_with(size, &options);
+	size_t count = map->size * 3 / 4, i = 0;
+	if(count > set->count)
+	{
+		count = set->count;
+	}
+	for(; i < count; i++)
+	{
+		set_n(map, set->keys[i], set->lens[i], (void *)set->keys[i]);
+	}
+	hash_statistics stats;
+	hash_stats(map, &stats);
+	printf(" %6.2f %7lu %7.2f %7lu", stats.mean_hit_probe,
+		stats.max_hit_probe, stats.mean_miss_probe, stats.max_miss_probe);
+	// The data are the keys, which free_hash() mustn't free
+	for(i = 0; i < count; i++)
+	{
+		delete_n(map, set->keys[i], set->lens[i]);
+	}
+	free_hash(map);
+}
+
+int main(int argc, char ** argv)
+{
+	size_t count = 100000;
+	const char * only = 0;
+	int c;
+	while((c = getopt(argc, argv, "n:f:h")) != -1)
+	{
+		switch(c)
+		{
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 'f':
+				only = optarg;
+				break;
+			case 'h':
+			default:
+				printf("%s\n%s", help, help_flags);
+				return 0;
+		}
+	}
+	unsigned int i = 0;
+	int known = only == 0;
+	for(; i < CANDIDATES; i++)
+	{
+		known |= only != 0 && strcmp(only, candidates[i].name) == 0;
+	}
+	if(count < 16 || !known)
+	{
+		printf("%s\n%s", help, help_flags);
+		return 1;
+	}
+
+	printf("Speed, bytes per %s, by key length\n%-14s",
+#if defined(__x86_64__) || defined(__i386__)
+		"cycle",
+#else
+		"nanosecond",
+#endif
+		"hash");
+	printf(" %8s %8s %8s %8s %8s %8s %8s\n", "4", "8", "16", "32", "64", "256",
+		"1024");
+	for(i = 0; i < CANDIDATES; i++)
+	{
+		if(only == 0 || strcmp(only, candidates[i].name) == 0)
+		{
+			speed(&candidates[i]);
+		}
+	}
+
+	printf("\nAvalanche over 2000 random keys: mean and worst bias of an "\
+		"output bit, worst\ncorrelation of two output bits (0 is ideal, and "\
+		"under 0.1 is sampling noise)\n");
+	printf("%-14s %4s %10s %10s %10s\n", "hash", "len", "mean bias",
+		"worst bias", "worst corr");
+	static const size_t avalanche_lens[] = {4, 8, 16, 40};
+	for(i = 0; i < CANDIDATES; i++)
+	{
+		if(only != 0 && strcmp(only, candidates[i].name) != 0)
+		{
+			continue;
+		}
+		unsigned int l = 0;
+		for(; l < sizeof(avalanche_lens) / sizeof(avalanche_lens[0]); l++)
+		{
+			avalanche(&candidates[i], avalanche_lens[l], 2000);
+		}
+	}
+
+	static const char * set_names[] = {"test", "url", "uuid"};
+	key_set sets[3];
+	for(i = 0; i < 3; i++)
+	{
+		sets[i] = make_keys(set_names[i], count);
+	}
+	int bucket_bits = 0;
+	while(((size_t)2 << bucket_bits) <= count / 8)
+	{
+		bucket_bits++;
+	}
+
+	printf("\nChi-square z-score of %zu keys over 2^%d buckets by the low "\
+		"bits (near 0 is\nas even as random)\n%-14s", count, bucket_bits,
+		"hash");
+	printf(" %8s %8s %8s\n", "test", "url", "uuid");
+	for(i = 0; i < CANDIDATES; i++)
+	{
+		if(only != 0 && strcmp(only, candidates[i].name) != 0)
+		{
+			continue;
+		}
+		printf("%-14s", candidates[i].name);
+		int s = 0;
+		for(; s < 3; s++)
+		{
+			printf(" %8.1f", chi_square(&candidates[i], &sets[s], bucket_bits));
+		}
+		printf("\n");
+	}
+
+	printf("\nProbe lengths of the same keys in a linearly probed map at 0.75 "\
+		"load:\nmean and max for hits, then misses\n");
+	static const hash_reduction reductions[] = {REDUCE_MODULO, REDUCE_POW2};
+	static const char * reduction_names[] = {"modulo", "pow2"};
+	int r = 0;
+	for(; r < 2; r++)
+	{
+		int s = 0;
+		for(; s < 3; s++)
+		{
+			printf("%s keys, %s\n", set_names[s], reduction_names[r]);
+			for(i = 0; i < CANDIDATES; i++)
+			{
+				if(only != 0 && strcmp(only, candidates[i].name) != 0)
+				{
+					continue;
+				}
+				printf("  %-14s", candidates[i].name);
+				probes(&candidates[i], &sets[s], reductions[r]);
+				printf("\n");
+				fflush(stdout);
+			}
+		}
+	}
+
+	for(i = 0; i < 3; i++)
+	{
+		free_keys(&sets[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include "sharded.h"
+#include <string.h>
+
+// Shard headers are padded out to a cache line each, so threads working on
+// neighbouring shards don't keep taking the line from each other.
+#define CACHE_LINE 64
+
+typedef struct
+{
+	hash * map;
+} __attribute__((aligned(CACHE_LINE))) shard;
+
+#define shard_at(sharded, index) (&((shard *)(sharded)->shards)[index])
+
+// Every shard was constructed with the same options, so hashes keys the
+// same way as the first
+#define sharded_key(sharded, key, len) \
+	hash_key(shard_at(sharded, 0)->map, key, len)
+
+sharded_hash * construct_sharded_hash(int size, int shards,
+	const hash_options * options)
+{
+	if(size < 0 || shards <= 0)
+	{
+		return 0;
+	}
+
+	// Round shards up to a power of two, at most 2^31 of them
+	unsigned int bits = 0;
+	while((1u << bits) < (unsigned int)shards && bits < 31)
+	{
+		bits++;
+	}
+
+	sharded_hash * sharded = malloc(sizeof(sharded_hash));
+	sharded->count = 1u << bits;
+	sharded->bits = bits;
+
+	void * memory;
+	if(posix_memalign(&memory, CACHE_LINE, sharded->count * sizeof(shard)))
+	{
+		free(sharded);
+		return 0;
+	}
+	sharded->shards = memory;
+
+	// Keys are hashed by the first shard's hash_key() before a shard is
+	// picked, so no shard can reseed on its own
+	hash_options shard_options = {0};
+	if(options)
+	{
+		shard_options = *options;
+	}
+	if(shard_options.reseed_at != 0 && shard_options.seed == 0)
+	{
+		shard_options.seed = hash_random_seed();
+	}
+	if(shard_options.reseed_at != 0 && shard_options.hash_with == 0)
+	{
+		shard_options.hash_with = hash_short_key;
+	}
+	shard_options.reseed_at = 0;
+
+	// Every shard gets its share of the cells, rounded up
+	int per_shard = (size + sharded->count - 1) / sharded->count;
+	unsigned int i = 0;
+	for(; i < sharded->count; i++)
+	{
+		shard_at(sharded, i)->map = construct_hash_with(per_shard,
+			&shard_options);
+	}
+
+	return sharded;
+}
+
+void free_sharded_hash(sharded_hash * sharded)
+{
+	unsigned int i = 0;
+	for(; i < sharded->count; i++)
+	{
+		free_hash(shard_at(sharded, i)->map);
+	}
+	free(sharded->shards);
+	free(sharded);
+}
+
+unsigned int sharded_shard_of(sharded_hash * sharded, const char * key,
+	size_t len)
+{
+	return hash_partition(sharded_key(sharded, key, len), sharded->bits);
+}
+
+hash * sharded_map(sharded_hash * sharded, unsigned int index)
+{
+	return shard_at(sharded, index)->map;
+}
+
+// The key is hashed once, for both routing and the shard's own probe
+int sharded_set(sharded_hash * sharded, const char * key, void * element)
+{
+	size_t len = strlen(key);
+	uint64_t h = sharded_key(sharded, key, len);
+	hash * map = shard_at(sharded, hash_partition(h, sharded->bits))->map;
+	return set_prehashed(map, key, len, h, element);
+}
+
+void * sharded_get(sharded_hash * sharded, const char * key)
+{
+	size_t len = strlen(key);
+	uint64_t h = sharded_key(sharded, key, len);
+	hash * map = shard_at(sharded, hash_partition(h, sharded->bits))->map;
+	return get_prehashed(map, key, len, h);
+}
+
+void * sharded_delete(sharded_hash * sharded, const char * key)
+{
+	size_t len = strlen(key);
+	uint64_t h = sharded_key(sharded, key, len);
+	hash * map = shard_at(sharded, hash_partition(h, sharded->bits))->map;
+	return delete_prehashed(map, key, len, h);
+}
+
+float sharded_load(sharded_hash * sharded)
+{
+	unsigned long in_use = 0, size = 0;
+	unsigned int i = 0;
+	for(; i < sharded->count; i++)
+	{
+		in_use += shard_at(sharded, i)->map->in_use;
+		size += shard_at(sharded, i)->map->size;
+	}
+	return ((float)in_use)/size;
+}
+
+void sharded_stats(sharded_hash * sharded, hash_statistics * stats)
+{
+	memset(stats, 0, sizeof(hash_statistics));
+	double hit_total = 0, miss_total = 0;
+	unsigned long cells = 0;
+	unsigned int i = 0;
+	for(; i < sharded->count; i++)
+	{
+		hash * map = shard_at(sharded, i)->map;
+		hash_statistics shard;
+		hash_stats(map, &shard);
+		stats->entries += shard.entries;
+		stats->tombstones += shard.tombstones;
+		stats->empty += shard.empty;
+		stats->unmoved += shard.unmoved;
+		stats->runs += shard.runs;
+		hit_total += shard.mean_hit_probe * shard.entries;
+		miss_total += shard.mean_miss_probe * map->size;
+		cells += map->size;
+		if(shard.max_hit_probe > stats->max_hit_probe)
+		{
+			stats->max_hit_probe = shard.max_hit_probe;
+		}
+		if(shard.max_miss_probe > stats->max_miss_probe)
+		{
+			stats->max_miss_probe = shard.max_miss_probe;
+		}
+		if(shard.max_run > stats->max_run)
+		{
+			stats->max_run = shard.max_run;
+		}
+		int b = 0;
+		for(; b < HASH_STATS_BUCKETS; b++)
+		{
+			stats->run_lengths[b] += shard.run_lengths[b];
+			stats->displacements[b] += shard.displacements[b];
+		}
+	}
+	stats->mean_hit_probe = stats->entries != 0 ? hit_total / stats->entries
+		: 0;
+	stats->mean_miss_probe = cells != 0 ? miss_total / cells : 0;
+}
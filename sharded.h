@@ -0,0 +1,51 @@
+#ifndef SHARDED_H_INCLUDED
+#define SHARDED_H_INCLUDED
+
+#include "hash.h"
+
+// A front for several independent maps, the shards, with every key routed
+// to one of them by its hash. Nothing is locked - instead, threads that
+// each stick to their own shards (see sharded_shard_of()) can write at the
+// same time without ever touching the same map. Data is owned by the map,
+// as with hash.
+typedef struct
+{
+	// The shard headers, each on its own cache line
+	void * shards;
+	unsigned int count;
+	// log2(count)
+	unsigned int bits;
+} sharded_hash;
+
+// Returns a map with room for size objects spread over shards shards
+// (rounded up to a power of two), each constructed with the options as in
+// construct_hash_with(). Shards never reseed, as keys are hashed before
+// their shard is picked: a reseed_at only gets every shard the same random
+// seed (and hash_short_key, without a hash_with). Returns a nullptr if size
+// is negative or shards isn't positive.
+sharded_hash * construct_sharded_hash(int size, int shards,
+	const hash_options * options);
+
+// Frees every shard and its data
+void free_sharded_hash(sharded_hash *);
+
+// Which shard a key goes to, and that shard's map - for threads that split
+// keys between them by shard
+unsigned int sharded_shard_of(sharded_hash *, const char * key, size_t len);
+hash * sharded_map(sharded_hash *, unsigned int shard);
+
+// set(), get() and delete() on whichever shard the key goes to. Only one
+// thread at a time may use any one shard.
+int sharded_set(sharded_hash *, const char * key, void * element);
+void * sharded_get(sharded_hash *, const char * key);
+void * sharded_delete(sharded_hash *, const char * key);
+
+// The load factor across all shards. Not safe while any shard is written.
+float sharded_load(sharded_hash *);
+
+// hash_stats() across all shards: counts and histograms summed, means
+// weighted by each shard's entries (hits) or cells (misses), and maxima
+// the largest of any shard. Not safe while any shard is written.
+void sharded_stats(sharded_hash *, hash_statistics * stats);
+
+#endif /* SHARDED_H_INCLUDED */
@@ -0,0 +1,118 @@
+#include "snapshot.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define part(mapped, offset) ((const char *)(mapped)->base + (offset))
+
+// By SNAPSHOT_CFARMHASH and so on
+static const hash_function snapshot_hashes[] = {hash_cfarmhash,
+	hash_superfasthash, hash_short_key};
+
+mapped_hash * hash_open_mmap(const char * path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		return 0;
+	}
+	struct stat info;
+	if(fstat(fd, &info) == -1 || info.st_size < (off_t)sizeof(snapshot_header))
+	{
+		close(fd);
+		return 0;
+	}
+	void * base = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping keeps the file open
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	// Check enough that a damaged or foreign file can't send a lookup
+	// outside the mapping
+	const snapshot_header * header = base;
+	if(header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION
+		|| header->header_size != sizeof(snapshot_header)
+		|| header->hash_with > SNAPSHOT_SHORT_KEY
+		|| header->file_size != (uint64_t)info.st_size
+		|| header->slots == 0 || (header->slots & (header->slots - 1)) != 0
+		|| header->count >= header->slots
+		|| header->ctrl_offset + header->slots > header->file_size
+		|| header->cells_offset + header->slots * sizeof(snapshot_cell)
+			> header->file_size
+		|| header->keys_offset > header->file_size
+		|| header->values_offset + header->count * header->value_size
+			> header->file_size)
+	{
+		munmap(base, info.st_size);
+		return 0;
+	}
+	// Lookups stop at an empty slot, so there has to be one - as there is
+	// when exactly count slots are full
+	const unsigned char * ctrl = (const unsigned char *)base
+		+ header->ctrl_offset;
+	uint64_t full = 0, i = 0;
+	for(; i < header->slots; i++)
+	{
+		full += ctrl[i] != SNAPSHOT_EMPTY;
+	}
+	if(full != header->count)
+	{
+		munmap(base, info.st_size);
+		return 0;
+	}
+
+	mapped_hash * mapped = malloc(sizeof(mapped_hash));
+	mapped->base = base;
+	mapped->length = info.st_size;
+	return mapped;
+}
+
+void hash_close_mmap(mapped_hash * mapped)
+{
+	munmap(mapped->base, mapped->length);
+	free(mapped);
+}
+
+const void * mapped_get(mapped_hash * mapped, const char * key)
+{
+	return mapped_get_n(mapped, key, strlen(key));
+}
+
+const void * mapped_get_n(mapped_hash * mapped, const void * key, size_t len)
+{
+	const snapshot_header * header = mapped->base;
+	const unsigned char * ctrl = (const unsigned char *)part(mapped,
+		header->ctrl_offset);
+	const snapshot_cell * cells = (const snapshot_cell *)part(mapped,
+		header->cells_offset);
+	uint64_t h = snapshot_hashes[header->hash_with](key, len,
+		header->hash_seed);
+	unsigned char tag = h >> 57;
+	uint64_t mask = header->slots - 1;
+	uint64_t index = h & mask;
+
+	// There's always an empty slot, so this ends
+	for(; ctrl[index] != SNAPSHOT_EMPTY; index = (index + 1) & mask)
+	{
+		const snapshot_cell * cell = &cells[index];
+		if((ctrl[index] == tag) && (cell->hashed_key == h)
+			&& (cell->key_len == len)
+			&& (header->keys_offset + cell->key_offset + len
+				<= header->file_size)
+			&& (memcmp(part(mapped, header->keys_offset + cell->key_offset),
+				key, len) == 0)
+			&& (cell->value_offset + header->value_size
+				<= header->count * header->value_size))
+		{
+			return header->value_size == 0
+				? part(mapped, header->keys_offset + cell->key_offset)
+				: part(mapped, header->values_offset + cell->value_offset);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include "hash.h"
+
+// Snapshots are files a map can be saved to with hash_save() and looked up
+// in, straight out of the page cache, with hash_open_mmap(). Nothing in
+// the file is a pointer - everything is an offset from the start of the
+// file - so it can be mapped anywhere, by any number of processes at once.
+//
+// The layout, each part starting on an 8-byte boundary:
+//   snapshot_header
+//   ctrl     slots bytes: SNAPSHOT_EMPTY, or the top 7 bits of the hash
+//   cells    slots snapshot_cells, linearly probed from hash & (slots - 1)
+//   keys     every key's bytes, one after another
+//   values   value_size bytes for every key, one after another
+// Numbers are in the byte order of the machine that saved the file; the
+// magic number reads wrong on a machine of the other order. Keys are
+// hashed the way the map hashed them, which the header records - so only
+// maps using one of the built-in hash functions can be saved.
+#define SNAPSHOT_MAGIC UINT64_C(0x485341484243504B)
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_EMPTY 0x80
+#define SNAPSHOT_CFARMHASH 0
+#define SNAPSHOT_SUPERFASTHASH 1
+#define SNAPSHOT_SHORT_KEY 2
+
+typedef struct
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t file_size;
+	uint64_t count;
+	uint64_t slots;
+	uint64_t value_size;
+	uint32_t hash_with;
+	uint32_t padding;
+	uint64_t hash_seed;
+	uint64_t ctrl_offset;
+	uint64_t cells_offset;
+	uint64_t keys_offset;
+	uint64_t values_offset;
+} snapshot_header;
+
+typedef struct
+{
+	uint64_t hashed_key;
+	uint64_t key_offset;
+	uint64_t key_len;
+	uint64_t value_offset;
+} snapshot_cell;
+
+// A snapshot opened with hash_open_mmap()
+typedef struct
+{
+	void * base;
+	size_t length;
+} mapped_hash;
+
+// Saves every key of the map to path, each with a copy of the first
+// value_size bytes its datum points to (so data has to be flat, with no
+// pointers of its own). With a value_size of 0 only keys are saved. The
+// file is written next to path and renamed over it at the end, so path is
+// never half written. Returns 0 if the file couldn't be written, or if the
+// map hashes with a function of its own.
+int hash_save(hash *, const char * path, size_t value_size);
+
+// Maps a snapshot read-only. Returns a nullptr if it can't be opened or
+// isn't a snapshot this version understands.
+mapped_hash * hash_open_mmap(const char * path);
+void hash_close_mmap(mapped_hash *);
+
+// get() and get_n() on a snapshot. The value is returned where it sits in
+// the mapping, so it's read-only and only valid until hash_close_mmap().
+// Snapshots saved without values return the saved key instead, so only
+// whether the result is null means anything.
+const void * mapped_get(mapped_hash *, const char * key);
+const void * mapped_get_n(mapped_hash *, const void * key, size_t len);
+
+#endif /* SNAPSHOT_H_INCLUDED */
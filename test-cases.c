@@ -1,4 +1,14 @@
 #include "hash.h"
+#include "cfarmhash.h"
+#include "concurrent.h"
+#include "sharded.h"
+#include "snapshot.h"
+#include "wal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -845,3 +855,1802 @@ int whole_cycle_million()
 	 
 	return 1;
 }
+
+/* GROUP PROBING TESTS */
+
+/* Fill a linear and a group-probing map of size 10 with the same keys.
+ * Group probing walks the same probe sequence, just faster.
+ * BEHAVIOR: Every key ends up in the same cell in both maps
+ */
+int group_same_cells()
+{
+	hash_options options = {PROBE_GROUP};
+	hash * linear = construct_hash(10);
+	hash * group = construct_hash_with(10, &options);
+
+	int i = 9;
+	int * number;
+	char string[50];
+	for(; i >= 0; i--)
+	{
+		sprintf(string, "Test%d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(linear, string, number));
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(group, string, number));
+	}
+
+	// Compare where each key was placed
+	for(i = 0; i < 10; i++)
+	{
+		assert(*(int *)retrieveLocation(linear, i)
+			== *(int *)retrieveLocation(group, i));
+	}
+
+	free_hash(linear);
+	free_hash(group);
+
+	return 1;
+}
+
+/* Set, get, delete and re-set keys in a group-probing map smaller than one
+ * group, so every probe wraps around the mirrored tail.
+ * BEHAVIOR: Every operation behaves as it does with linear probing
+ */
+int group_tiny_wrap()
+{
+	hash_options options = {PROBE_GROUP};
+	hash * obj = construct_hash_with(3, &options);
+	int a = 1, b = 2, c = 3;
+
+	assert(set(obj, "Test1", &a));
+	assert(set(obj, "Test2", &b));
+	assert(set(obj, "Test3", &c));
+	assert(set(obj, "Test4", &c) == 0);
+	assert(load(obj) == 1);
+
+	assert(*(int *)get(obj, "Test1") == 1);
+	assert(*(int *)get(obj, "Test2") == 2);
+	assert(*(int *)get(obj, "Test3") == 3);
+	assert(get(obj, "Test4") == 0);
+
+	// Leave a was_used cell behind and make sure it's reused
+	assert(*(int *)delete(obj, "Test2") == 2);
+	assert(get(obj, "Test2") == 0);
+	assert(*(int *)get(obj, "Test3") == 3);
+	assert(set(obj, "Test4", &b));
+	assert(*(int *)get(obj, "Test4") == 2);
+
+	// Data is on the stack, don't let free_hash() free it
+	assert(delete(obj, "Test1") == &a);
+	assert(delete(obj, "Test3") == &c);
+	assert(delete(obj, "Test4") == &b);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* set(), get(), miss and delete() 950,000 values in a group-probing map of
+ * size 1,000,000 - the load factor group probing is meant for.
+ * BEHAVIOR: Return 1, with all operations successful on each key.
+ */
+int group_cycle_million()
+{
+	hash_options options = {PROBE_GROUP};
+	hash * obj = construct_hash_with(1000000, &options);
+
+	int i = 949999;
+	int * number;
+	char string[50];
+	for(; i >= 0; i--)
+	{
+		sprintf(string, "Test%d", i);
+		number = (int *) malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, (void *)number));
+	}
+
+	for(i = 0; i < 950000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		assert(*(int *)get(obj, string) == i);
+		sprintf(string, "Test%ds", i);
+		assert(get(obj, string) == 0);
+	}
+
+	for(i = 0; i < 950000; i += 2)
+	{
+		sprintf(string, "Test%d", i);
+		number = delete(obj, string);
+		assert(*number == i);
+		free(number);
+	}
+	assert(load(obj) == (float)475000/1000000);
+
+	for(i = 1; i < 950000; i += 2)
+	{
+		sprintf(string, "Test%d", i);
+		assert(*(int *)get(obj, string) == i);
+	}
+
+	free_hash(obj);
+
+	return 1;
+}
+
+/* REDUCTION TESTS */
+
+/* Make maps of size 1,000 with each reduction policy, and one of INT_MAX
+ * cells with power-of-two reduction.
+ * BEHAVIOR: Sizes are rounded to a power of two and a prime, otherwise kept;
+ * a size that would round past INT_MAX gives a nullptr
+ */
+int reduce_sizes()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_MODULO};
+	hash * obj = construct_hash_with(1000, &options);
+	assert(obj->size == 1000);
+	free_hash(obj);
+
+	options.reduction = REDUCE_POW2;
+	obj = construct_hash_with(1000, &options);
+	assert(obj->size == 1024);
+	free_hash(obj);
+	// Cell indices are ints, so there's no rounding up to 2^31
+	assert(construct_hash_with(INT_MAX, &options) == 0);
+
+	options.reduction = REDUCE_FASTRANGE;
+	obj = construct_hash_with(1000, &options);
+	assert(obj->size == 1000);
+	free_hash(obj);
+
+	options.reduction = REDUCE_PRIME;
+	obj = construct_hash_with(1000, &options);
+	assert(obj->size == 1009);
+	free_hash(obj);
+
+	// Already a prime, so nothing to round
+	obj = construct_hash_with(1009, &options);
+	assert(obj->size == 1009);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* Fill, get, miss and delete 2,000 values with every reduction policy and
+ * every probing scheme, filling each map completely.
+ * BEHAVIOR: Every operation succeeds regardless of policy
+ */
+int reduce_cycle_all()
+{
+	int probing = PROBE_LINEAR;
+	for(; probing <= PROBE_ROBIN_HOOD; probing++)
+	{
+		int reduction = REDUCE_MODULO;
+		for(; reduction <= REDUCE_PRIME; reduction++)
+		{
+			hash_options options = {probing, reduction};
+			hash * obj = construct_hash_with(2000, &options);
+
+			int i = 0;
+			int count = obj->size;
+			int * number;
+			char string[50];
+			for(; i < count; i++)
+			{
+				sprintf(string, "Test%d", i);
+				number = malloc(sizeof(int));
+				*number = i;
+				assert(set(obj, string, number));
+			}
+			assert(load(obj) == 1);
+
+			for(i = 0; i < count; i++)
+			{
+				sprintf(string, "Test%d", i);
+				assert(*(int *)get(obj, string) == i);
+				sprintf(string, "Test%ds", i);
+				assert(get(obj, string) == 0);
+			}
+
+			for(i = 0; i < count; i++)
+			{
+				sprintf(string, "Test%d", i);
+				number = delete(obj, string);
+				assert(*number == i);
+				free(number);
+			}
+			assert(load(obj) == 0);
+
+			free_hash(obj);
+		}
+	}
+
+	return 1;
+}
+
+/* ROBIN HOOD TESTS */
+
+/* Fill a Robin Hood map of size 3 completely, then delete from the middle
+ * of the wrapped run and set again. Small enough that every run wraps.
+ * BEHAVIOR: Every key stays reachable after shifting back
+ */
+int robin_hood_tiny_wrap()
+{
+	hash_options options = {PROBE_ROBIN_HOOD};
+	hash * obj = construct_hash_with(3, &options);
+	int a = 1, b = 2, c = 3;
+
+	assert(set(obj, "Test1", &a));
+	assert(set(obj, "Test2", &b));
+	assert(set(obj, "Test3", &c));
+	assert(set(obj, "Test4", &c) == 0);
+	assert(load(obj) == 1);
+
+	assert(*(int *)get(obj, "Test1") == 1);
+	assert(*(int *)get(obj, "Test2") == 2);
+	assert(*(int *)get(obj, "Test3") == 3);
+	assert(get(obj, "Test4") == 0);
+
+	assert(*(int *)delete(obj, "Test2") == 2);
+	assert(get(obj, "Test2") == 0);
+	assert(*(int *)get(obj, "Test1") == 1);
+	assert(*(int *)get(obj, "Test3") == 3);
+	assert(set(obj, "Test4", &b));
+	assert(*(int *)get(obj, "Test4") == 2);
+
+	// Overwriting doesn't take another cell
+	assert(*(int *)delete(obj, "Test1") == 1);
+	assert(set(obj, "Test4", &a));
+	assert(load(obj) == (float)2/3);
+	assert(*(int *)get(obj, "Test4") == 1);
+
+	// Data is on the stack, don't let free_hash() free it
+	assert(delete(obj, "Test3") == &c);
+	assert(delete(obj, "Test4") == &a);
+	assert(load(obj) == 0);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* Churn a Robin Hood map of size 100,000: fill to 95%, then repeatedly
+ * delete a key and set a new one, checking keys set before the churn.
+ * This is the workload that leaves was_used cells everywhere otherwise.
+ * BEHAVIOR: Return 1, with all operations successful on each key.
+ */
+int robin_hood_churn()
+{
+	hash_options options = {PROBE_ROBIN_HOOD};
+	hash * obj = construct_hash_with(100000, &options);
+
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 95000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+	}
+
+	// Replace keys 0..189,999 one at a time with 95,000..284,999
+	for(i = 0; i < 190000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		number = delete(obj, string);
+		assert(*number == i);
+		free(number);
+		assert(get(obj, string) == 0);
+
+		sprintf(string, "Test%d", i + 95000);
+		number = malloc(sizeof(int));
+		*number = i + 95000;
+		assert(set(obj, string, number));
+	}
+	assert(load(obj) == (float)95000/100000);
+
+	for(i = 190000; i < 285000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		assert(*(int *)get(obj, string) == i);
+		sprintf(string, "Test%ds", i);
+		assert(get(obj, string) == 0);
+	}
+
+	free_hash(obj);
+
+	return 1;
+}
+
+/* GROWTH TESTS */
+
+/* Set 100,000 values into maps that start at size 0 and grow at a load
+ * factor of 0.75, with every probing scheme. Overwrite and delete keys while
+ * they're still being moved out of the old cells.
+ * BEHAVIOR: set() never fails, and every key is found until deleted
+ */
+int grow_from_zero()
+{
+	int probing = PROBE_LINEAR;
+	for(; probing <= PROBE_ROBIN_HOOD; probing++)
+	{
+		hash_options options = {probing, REDUCE_MODULO, 0.75};
+		hash * obj = construct_hash_with(0, &options);
+
+		int i = 0;
+		int * number;
+		char string[50];
+		for(; i < 100000; i++)
+		{
+			sprintf(string, "Test%d", i);
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set(obj, string, number));
+			assert(load(obj) <= 0.75);
+
+			// Overwrite and delete recent keys, which are the ones most
+			// likely to still be in the old cells
+			if(i % 3 == 0 && (i / 2) % 7 != 0)
+			{
+				sprintf(string, "Test%d", i / 2);
+				number = malloc(sizeof(int));
+				*number = i / 2;
+				free(get(obj, string));
+				assert(set(obj, string, number));
+			}
+			if(i % 7 == 0)
+			{
+				sprintf(string, "Test%d", i);
+				free(delete(obj, string));
+				assert(get(obj, string) == 0);
+			}
+		}
+		assert(obj->size > 100000);
+
+		for(i = 0; i < 100000; i++)
+		{
+			sprintf(string, "Test%d", i);
+			if(i % 7 == 0)
+			{
+				assert(get(obj, string) == 0);
+			}
+			else
+			{
+				assert(*(int *)get(obj, string) == i);
+			}
+		}
+
+		free_hash(obj);
+	}
+
+	return 1;
+}
+
+/* Grow a prime-sized map of size 10, freeing it in the middle of growing.
+ * BEHAVIOR: Sizes stay prime, and entries in the old cells are freed too
+ */
+int grow_prime_free_midway()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_PRIME, 0.9};
+	hash * obj = construct_hash_with(10, &options);
+	assert(obj->size == 11);
+
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 10; i++)
+	{
+		sprintf(string, "Test%d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+	}
+	// The 10th key needed to grow, and one step doesn't move 11 cells
+	assert(obj->size == 23);
+	assert(obj->old != 0);
+	assert(load(obj) == (float)10/23);
+
+	free_hash(obj);
+
+	return 1;
+}
+
+/* TOMBSTONE PURGE TESTS */
+
+/* Fill a map of size 1,000, delete everything, then keep setting and
+ * deleting one more key so set() and delete() get to sweep.
+ * BEHAVIOR: The was_used cells drop back under a quarter of the free cells
+ */
+int purge_after_delete_all()
+{
+	hash * obj = construct_hash(1000);
+
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 1000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+	}
+	for(i = 0; i < 1000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		free(delete(obj, string));
+	}
+	assert(obj->tombstones > 1000 / 4);
+
+	int a = 5;
+	for(i = 0; i < 1000 && obj->tombstones > 1000 / 4; i++)
+	{
+		assert(set(obj, "Other", &a));
+		assert(delete(obj, "Other") == &a);
+	}
+	assert(obj->tombstones <= 1000 / 4);
+	assert(load(obj) == 0);
+
+	free_hash(obj);
+
+	return 1;
+}
+
+/* Churn a linearly probed map of size 100,000 at 95% load, deleting a key
+ * and setting a new one 190,000 times. Re-set a few keys sitting behind
+ * was_used cells along the way.
+ * BEHAVIOR: Every key stays reachable, and nothing gets stored twice
+ */
+int purge_churn()
+{
+	int probing = PROBE_LINEAR;
+	for(; probing <= PROBE_GROUP; probing++)
+	{
+		hash_options options = {probing};
+		hash * obj = construct_hash_with(100000, &options);
+
+		int i = 0;
+		int * number;
+		char string[50];
+		for(; i < 95000; i++)
+		{
+			sprintf(string, "Test%d", i);
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set(obj, string, number));
+		}
+
+		for(i = 0; i < 190000; i++)
+		{
+			sprintf(string, "Test%d", i);
+			number = delete(obj, string);
+			assert(*number == i);
+			free(number);
+			assert(get(obj, string) == 0);
+
+			sprintf(string, "Test%d", i + 95000);
+			number = malloc(sizeof(int));
+			*number = i + 95000;
+			assert(set(obj, string, number));
+
+			// Overwrite a key that's been around a while
+			sprintf(string, "Test%d", i + 50000);
+			number = malloc(sizeof(int));
+			*number = i + 50000;
+			free(get(obj, string));
+			assert(set(obj, string, number));
+		}
+		assert(load(obj) == (float)95000/100000);
+		assert(obj->tombstones <= 5000 / 4 + 1);
+
+		for(i = 190000; i < 285000; i++)
+		{
+			sprintf(string, "Test%d", i);
+			number = delete(obj, string);
+			assert(*number == i);
+			free(number);
+			assert(get(obj, string) == 0);
+		}
+		assert(load(obj) == 0);
+
+		free_hash(obj);
+	}
+
+	return 1;
+}
+
+/* PREHASHED TESTS */
+
+/* Hash 1,000 keys once and use each hash to set, get and delete the key in
+ * two maps with different probing schemes, mixing in the plain functions.
+ * BEHAVIOR: Prehashed and plain calls see the same entries
+ */
+int prehashed_two_maps()
+{
+	hash_options options = {PROBE_ROBIN_HOOD};
+	hash * first = construct_hash(1000);
+	hash * second = construct_hash_with(1000, &options);
+
+	int i = 0;
+	int numbers[1000];
+	char string[50];
+	for(; i < 1000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		size_t len = strlen(string);
+		uint64_t h = hash_key(first, string, len);
+		numbers[i] = i;
+		assert(set_prehashed(first, string, len, h, &numbers[i]));
+		assert(set_prehashed(second, string, len, h, &numbers[i]));
+	}
+
+	for(i = 0; i < 1000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		size_t len = strlen(string);
+		uint64_t h = hash_key(first, string, len);
+		assert(get(first, string) == &numbers[i]);
+		assert(get_prehashed(second, string, len, h) == &numbers[i]);
+		assert(delete_prehashed(first, string, len, h) == &numbers[i]);
+		assert(delete(second, string) == &numbers[i]);
+		assert(get_prehashed(first, string, len, h) == 0);
+		assert(get(second, string) == 0);
+	}
+
+	free_hash(first);
+	free_hash(second);
+
+	return 1;
+}
+
+/* LENGTH-AWARE KEY TESTS */
+
+/* Use binary keys that only differ after a '\0', or by length alone.
+ * BEHAVIOR: Each key is its own entry, and C-string calls see the same
+ * entries as length-aware ones
+ */
+int binary_keys()
+{
+	hash * obj = construct_hash(10);
+	const unsigned char first[] = {0, 1, 2, 3};
+	const unsigned char second[] = {0, 1, 2, 4};
+	uint64_t id = 0x0102030405060708ULL;
+	int a = 1, b = 2, c = 3, d = 4, e = 5;
+
+	assert(set_n(obj, first, sizeof(first), &a));
+	assert(set_n(obj, second, sizeof(second), &b));
+	assert(set_n(obj, &id, sizeof(id), &c));
+	assert(set_n(obj, "Test", 4, &d));
+	assert(set_n(obj, "Test", 5, &e));  // with the '\0'
+	assert(load(obj) == (float)5/10);
+
+	assert(get_n(obj, first, sizeof(first)) == &a);
+	assert(get_n(obj, second, sizeof(second)) == &b);
+	assert(get_n(obj, first, 3) == 0);
+	assert(get_n(obj, &id, sizeof(id)) == &c);
+	assert(get(obj, "Test") == &d);
+	assert(get_n(obj, "Test", 5) == &e);
+
+	assert(delete_n(obj, first, sizeof(first)) == &a);
+	assert(get_n(obj, first, sizeof(first)) == 0);
+	assert(get_n(obj, second, sizeof(second)) == &b);
+	assert(delete(obj, "Test") == &d);
+	assert(get_n(obj, "Test", 5) == &e);
+
+	// Data is on the stack, don't let free_hash() free it
+	assert(delete_n(obj, second, sizeof(second)) == &b);
+	assert(delete_n(obj, &id, sizeof(id)) == &c);
+	assert(delete_n(obj, "Test", 5) == &e);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* BATCHED GET TESTS */
+
+/* Fill a map with 10,000 values, then look up 20,000 keys with get_many(),
+ * half of which aren't there, in batches that don't divide evenly.
+ * BEHAVIOR: Every result matches what get() returns
+ */
+int get_many_mixed()
+{
+	hash * obj = construct_hash(20000);
+
+	int i = 0;
+	int * number;
+	char strings[20000][20];
+	const char * keys[20000];
+	void * found[20000];
+	for(; i < 20000; i++)
+	{
+		sprintf(strings[i], i % 2 ? "Test%d" : "Missing%d", i);
+		keys[i] = strings[i];
+		if(i % 2)
+		{
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set(obj, keys[i], number));
+		}
+	}
+
+	get_many(obj, keys, 20000, found);
+	for(i = 0; i < 20000; i++)
+	{
+		assert(found[i] == get(obj, keys[i]));
+		assert(i % 2 ? *(int *)found[i] == i : found[i] == 0);
+	}
+
+	// Odd-sized and empty batches
+	get_many(obj, keys + 1, 37, found);
+	for(i = 0; i < 37; i++)
+	{
+		assert(found[i] == get(obj, keys[i + 1]));
+	}
+	get_many(obj, keys, 0, found);
+
+	free_hash(obj);
+
+	return 1;
+}
+
+/* STORED KEY TESTS */
+
+/* Give 200 different keys, short and long, the same prehashed hash in maps
+ * of each probing scheme, then overwrite and delete half of them.
+ * BEHAVIOR: Keys with the same hash are kept apart by the keys themselves
+ */
+int stored_keys_same_hash()
+{
+	int probing = PROBE_LINEAR;
+	for(; probing <= PROBE_ROBIN_HOOD; probing++)
+	{
+		hash_options options = {probing};
+		hash * obj = construct_hash_with(200, &options);
+
+		int i = 0;
+		int * number;
+		char string[50];
+		for(; i < 200; i++)
+		{
+			// Every other key is too long to store inline
+			sprintf(string, i % 2 ? "Test%d" : "A much longer test key %d", i);
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set_prehashed(obj, string, strlen(string), 42, number));
+		}
+		assert(obj->in_use == 200);
+
+		for(i = 0; i < 200; i++)
+		{
+			sprintf(string, i % 2 ? "Test%d" : "A much longer test key %d", i);
+			assert(*(int *)get_prehashed(obj, string, strlen(string), 42) == i);
+		}
+		assert(get_prehashed(obj, "Test", 4, 42) == 0);
+
+		// Overwrite the odd keys and delete the even ones
+		for(i = 0; i < 200; i++)
+		{
+			sprintf(string, i % 2 ? "Test%d" : "A much longer test key %d", i);
+			if(i % 2)
+			{
+				number = get_prehashed(obj, string, strlen(string), 42);
+				*number = -i;
+				assert(set_prehashed(obj, string, strlen(string), 42, number));
+			}
+			else
+			{
+				free(delete_prehashed(obj, string, strlen(string), 42));
+			}
+		}
+		assert(obj->in_use == 100);
+
+		for(i = 0; i < 200; i++)
+		{
+			sprintf(string, i % 2 ? "Test%d" : "A much longer test key %d", i);
+			number = get_prehashed(obj, string, strlen(string), 42);
+			assert(i % 2 ? *number == -i : number == 0);
+		}
+
+		free_hash(obj);
+	}
+
+	return 1;
+}
+
+/* Set, delete and set again 20,000 keys of 16 to 400 bytes, plus a key
+ * bigger than an arena chunk, in a growing map.
+ * BEHAVIOR: Every key is found until deleted, whatever its length
+ */
+int stored_keys_long_churn()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_MODULO, 0.75};
+	hash * obj = construct_hash_with(0, &options);
+
+	int i = 0, round = 0;
+	int * number;
+	char string[420];
+	for(; round < 3; round++)
+	{
+		for(i = 0; i < 20000; i++)
+		{
+			// Lengths from 16 to 400 bytes, so every size class is used
+			memset(string, 'a' + round, 16 + i % 385);
+			sprintf(string + 16 + i % 385, "%d", i);
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set(obj, string, number));
+		}
+		for(i = 0; i < 20000; i++)
+		{
+			memset(string, 'a' + round, 16 + i % 385);
+			sprintf(string + 16 + i % 385, "%d", i);
+			assert(*(int *)get(obj, string) == i);
+			if(i % 2)
+			{
+				free(delete(obj, string));
+				assert(get(obj, string) == 0);
+			}
+		}
+	}
+	assert(obj->in_use == 30000);
+
+	char * huge = malloc(100000);
+	memset(huge, 'z', 99999);
+	huge[99999] = '\0';
+	number = malloc(sizeof(int));
+	*number = -1;
+	assert(set(obj, huge, number));
+	assert(get(obj, huge) == number);
+	huge[0] = 'y';
+	assert(get(obj, huge) == 0);
+	free(huge);
+
+	free_hash(obj);
+
+	return 1;
+}
+
+/* CONCURRENT TESTS */
+
+// Each thread sets, checks and deletes keys of its own
+static concurrent_hash * shared_map;
+
+static void * concurrent_worker(void * arg)
+{
+	int thread = *(int *)arg;
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 20000; i++)
+	{
+		sprintf(string, "Thread%dTest%d", thread, i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(concurrent_set(shared_map, string, number));
+	}
+	for(i = 0; i < 20000; i++)
+	{
+		sprintf(string, "Thread%dTest%d", thread, i);
+		assert(*(int *)concurrent_get(shared_map, string) == i);
+		if(i % 2)
+		{
+			free(concurrent_delete(shared_map, string));
+		}
+	}
+	return 0;
+}
+
+/* Set 20,000 keys from each of 8 threads at once into a growing map with
+ * 16 stripes, then check and delete half of them from the same threads.
+ * BEHAVIOR: No key is lost or mixed up, and the load stays under grow_at
+ */
+int concurrent_eight_threads()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_MODULO, 0.75};
+	shared_map = construct_concurrent_hash(0, 16, &options);
+	assert(shared_map->count == 16);
+
+	pthread_t threads[8];
+	int ids[8];
+	int t = 0;
+	for(; t < 8; t++)
+	{
+		ids[t] = t;
+		assert(pthread_create(&threads[t], 0, concurrent_worker, &ids[t]) == 0);
+	}
+	for(t = 0; t < 8; t++)
+	{
+		pthread_join(threads[t], 0);
+	}
+
+	int i = 0;
+	char string[50];
+	for(t = 0; t < 8; t++)
+	{
+		for(i = 0; i < 20000; i++)
+		{
+			sprintf(string, "Thread%dTest%d", t, i);
+			int * number = concurrent_get(shared_map, string);
+			assert(i % 2 ? number == 0 : *number == i);
+		}
+	}
+	assert(concurrent_load(shared_map) > 0 && concurrent_load(shared_map) <= 0.75);
+
+	free_concurrent_hash(shared_map);
+
+	return 1;
+}
+
+// Writers keep deleting keys and setting them again while readers look
+// them up, for lock-free reads
+static atomic_int writers_done;
+
+static void * lock_free_writer(void * arg)
+{
+	int writer = *(int *)arg;
+	int round = 0, i = 0;
+	char string[50];
+	for(; round < 20; round++)
+	{
+		// Each writer has the keys i with i % 2 == writer
+		for(i = writer; i < 5000; i += 2)
+		{
+			sprintf(string, "Test%d", i);
+			concurrent_defer(shared_map, concurrent_delete(shared_map, string),
+				free);
+			int * number = malloc(sizeof(int));
+			*number = i;
+			assert(concurrent_set(shared_map, string, number));
+		}
+	}
+	atomic_fetch_add(&writers_done, 1);
+	return 0;
+}
+
+static void * lock_free_reader(void * arg)
+{
+	int i = 0;
+	char string[50];
+	while(atomic_load(&writers_done) < 2)
+	{
+		for(i = 0; i < 5000; i++)
+		{
+			sprintf(string, "Test%d", i);
+			concurrent_enter(shared_map);
+			int * number = concurrent_get(shared_map, string);
+			assert(number == 0 || *number == i);
+			concurrent_exit(shared_map);
+		}
+	}
+	return 0;
+}
+
+/* Delete and set 5,000 keys 20 times over from 2 threads, while 4 threads
+ * look them up without locks, in a map that starts too small.
+ * BEHAVIOR: Readers only ever find a key's own value, and nothing they
+ * find is freed while they're using it
+ */
+int concurrent_lock_free_reads()
+{
+	shared_map = construct_concurrent_hash_lock_free(100, 4);
+	atomic_init(&writers_done, 0);
+
+	pthread_t threads[6];
+	int ids[6];
+	int t = 0;
+	for(; t < 6; t++)
+	{
+		ids[t] = t;
+		assert(pthread_create(&threads[t], 0,
+			t < 2 ? lock_free_writer : lock_free_reader, &ids[t]) == 0);
+	}
+	for(t = 0; t < 6; t++)
+	{
+		pthread_join(threads[t], 0);
+	}
+
+	int i = 0;
+	char string[50];
+	for(; i < 5000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		assert(*(int *)concurrent_get(shared_map, string) == i);
+	}
+	assert(concurrent_load(shared_map) <= 0.75);
+
+	free_concurrent_hash(shared_map);
+
+	return 1;
+}
+
+// Two keys with the same home cell, which one writer keeps swapping: the
+// cell one of them is deleted from is where the other is set next
+static char shared_home[2][50];
+static int shared_home_values[2] = {0, 1};
+
+static void * shared_home_writer(void * arg)
+{
+	int round = 0;
+	for(; round < 100000; round++)
+	{
+		concurrent_delete(shared_map, shared_home[0]);
+		assert(concurrent_set(shared_map, shared_home[1],
+			&shared_home_values[1]));
+		concurrent_delete(shared_map, shared_home[1]);
+		assert(concurrent_set(shared_map, shared_home[0],
+			&shared_home_values[0]));
+	}
+	atomic_fetch_add(&writers_done, 1);
+	return 0;
+}
+
+static void * shared_home_reader(void * arg)
+{
+	while(atomic_load(&writers_done) < 1)
+	{
+		int key = 0;
+		for(; key < 2; key++)
+		{
+			int * value = concurrent_get(shared_map, shared_home[key]);
+			assert(value == 0 || *value == key);
+		}
+	}
+	return 0;
+}
+
+/* Delete one key and set another with the same home cell 200,000 times
+ * from one thread, while 4 threads look both up without locks.
+ * BEHAVIOR: Readers never find one key's value under the other, though
+ * the cell a key was found in may hold the other key by the time it's read
+ */
+int concurrent_lock_free_shared_home()
+{
+	shared_map = construct_concurrent_hash_lock_free(8, 1);
+	atomic_init(&writers_done, 0);
+
+	// Low bits in common put them in the same home cell of any table up
+	// to 2^16 cells, and there's only one stripe
+	sprintf(shared_home[0], "Test%d", 0);
+	uint64_t home = shared_map->hash_with(shared_home[0],
+		strlen(shared_home[0]), shared_map->seed) & 0xFFFF;
+	int i = 1;
+	for(;; i++)
+	{
+		sprintf(shared_home[1], "Test%d", i);
+		if((shared_map->hash_with(shared_home[1], strlen(shared_home[1]),
+			shared_map->seed) & 0xFFFF) == home)
+		{
+			break;
+		}
+	}
+	assert(concurrent_set(shared_map, shared_home[0], &shared_home_values[0]));
+
+	pthread_t threads[5];
+	int t = 0;
+	for(; t < 5; t++)
+	{
+		assert(pthread_create(&threads[t], 0,
+			t == 0 ? shared_home_writer : shared_home_reader, 0) == 0);
+	}
+	for(t = 0; t < 5; t++)
+	{
+		pthread_join(threads[t], 0);
+	}
+
+	assert(*(int *)concurrent_get(shared_map, shared_home[0]) == 0);
+	assert(concurrent_get(shared_map, shared_home[1]) == 0);
+
+	// The values aren't the map's to free
+	concurrent_delete(shared_map, shared_home[0]);
+	free_concurrent_hash(shared_map);
+
+	return 1;
+}
+
+/* SHARDED TESTS */
+
+// Each thread sets every key in the shards it owns
+static sharded_hash * shared_shards;
+
+static void * sharded_worker(void * arg)
+{
+	unsigned int thread = *(int *)arg;
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 100000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		if(sharded_shard_of(shared_shards, string, strlen(string)) % 4
+			== thread)
+		{
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(sharded_set(shared_shards, string, number));
+		}
+	}
+	return 0;
+}
+
+/* Set 100,000 keys from 4 threads into a growing map of 16 shards, each
+ * thread only setting keys in its own 4 shards.
+ * BEHAVIOR: Every key is found through the sharded map, in the shard it
+ * was routed to, and keys are spread over every shard; stats across the
+ * shards count every key, and add up to what each shard's stats say
+ */
+int sharded_four_threads()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_MODULO, 0.75};
+	shared_shards = construct_sharded_hash(0, 10, &options);
+	assert(shared_shards->count == 16);
+
+	pthread_t threads[4];
+	int ids[4];
+	int t = 0;
+	for(; t < 4; t++)
+	{
+		ids[t] = t;
+		assert(pthread_create(&threads[t], 0, sharded_worker, &ids[t]) == 0);
+	}
+	for(t = 0; t < 4; t++)
+	{
+		pthread_join(threads[t], 0);
+	}
+
+	int i = 0;
+	char string[50];
+	unsigned long total = 0;
+	for(; i < 100000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		unsigned int shard = sharded_shard_of(shared_shards, string,
+			strlen(string));
+		assert(*(int *)get(sharded_map(shared_shards, shard), string) == i);
+		assert(*(int *)sharded_get(shared_shards, string) == i);
+	}
+	for(i = 0; i < 16; i++)
+	{
+		assert(sharded_map(shared_shards, i)->in_use > 0);
+		total += sharded_map(shared_shards, i)->in_use;
+	}
+	assert(total == 100000);
+	assert(sharded_load(shared_shards) <= 0.75);
+
+	hash_statistics stats, shard;
+	sharded_stats(shared_shards, &stats);
+	assert(stats.entries + stats.unmoved == 100000);
+	unsigned long max_hit_probe = 0, runs = 0;
+	for(i = 0; i < 16; i++)
+	{
+		hash_stats(sharded_map(shared_shards, i), &shard);
+		runs += shard.runs;
+		if(shard.max_hit_probe > max_hit_probe)
+		{
+			max_hit_probe = shard.max_hit_probe;
+		}
+	}
+	assert(stats.runs == runs && stats.max_hit_probe == max_hit_probe);
+	assert(stats.mean_hit_probe >= 1 && stats.mean_hit_probe <= max_hit_probe);
+
+	sprintf(string, "Test%d", 7);
+	free(sharded_delete(shared_shards, string));
+	assert(sharded_get(shared_shards, string) == 0);
+
+	free_sharded_hash(shared_shards);
+
+	return 1;
+}
+
+/* BULK BUILD TESTS */
+
+/* Build maps from 200,000 pairs, some with long keys and a tenth of them
+ * repeating an earlier key, on 8 threads - into an empty fixed-size map,
+ * an empty growing map, a Robin Hood map and a map that isn't empty.
+ * BEHAVIOR: Every key ends up with the value of its last pair, just as if
+ * each pair had been set() in order
+ */
+int build_eight_threads()
+{
+	static char strings[200000][40];
+	static const char * keys[200000];
+	static size_t lens[200000];
+	static void * vals[200000];
+	hash_options options[4] = {
+		{PROBE_LINEAR},
+		{PROBE_GROUP, REDUCE_POW2, 0.75},
+		{PROBE_ROBIN_HOOD},
+		{PROBE_LINEAR, REDUCE_MODULO, 0.75}};
+
+	int m = 0;
+	for(; m < 4; m++)
+	{
+		hash * obj = construct_hash_with(m % 2 ? 0 : 250000, &options[m]);
+		if(m == 3)
+		{
+			assert(set(obj, "Test0", malloc(sizeof(int))));
+		}
+
+		int i = 0;
+		int * number;
+		for(; i < 200000; i++)
+		{
+			// Every tenth pair repeats the key of the pair before it
+			int key = i % 10 == 9 ? i - 1 : i;
+			sprintf(strings[i], key % 3 ? "Test%d" : "A longer test key %d", key);
+			keys[i] = strings[i];
+			lens[i] = strlen(strings[i]);
+			number = malloc(sizeof(int));
+			*number = i;
+			vals[i] = number;
+		}
+		// The repeats would leak otherwise - keep their first values
+		static void * replaced[20000];
+		for(i = 0; i < 20000; i++)
+		{
+			replaced[i] = vals[i * 10 + 8];
+		}
+
+		assert(hash_build(obj, keys, lens, vals, 200000, 8));
+		assert(obj->in_use == 180000 + (m == 3));
+
+		for(i = 0; i < 200000; i++)
+		{
+			int last = i % 10 == 8 ? i + 1 : i;
+			assert(*(int *)get_n(obj, keys[i], lens[i]) == last);
+		}
+		for(i = 0; i < 20000; i++)
+		{
+			free(replaced[i]);
+		}
+		free_hash(obj);
+	}
+
+	return 1;
+}
+
+/* FROZEN MAP TESTS */
+
+/* Freeze maps of 0 to 100,000 keys, short and long, one of them while it's
+ * still growing, then look up every key and as many that were never set.
+ * BEHAVIOR: The frozen map finds the same value for every key as the map
+ * did, and nothing for other keys
+ */
+int freeze_sizes()
+{
+	int sizes[5] = {0, 1, 2, 1000, 100000};
+	int s = 0;
+	for(; s < 5; s++)
+	{
+		hash_options options = {PROBE_LINEAR, REDUCE_MODULO, 0.75};
+		hash * obj = construct_hash_with(0, &options);
+
+		int i = 0;
+		int * number;
+		char string[50];
+		for(; i < sizes[s]; i++)
+		{
+			sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set(obj, string, number));
+		}
+		if(s == 4)
+		{
+			assert(obj->old != 0);
+		}
+
+		frozen_hash * frozen = hash_freeze(obj);
+		assert(frozen != 0);
+		assert(frozen->size == (unsigned long)sizes[s]);
+		for(i = 0; i < sizes[s]; i++)
+		{
+			sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+			assert(*(int *)frozen_get(frozen, string) == i);
+			sprintf(string, "Missing%d", i);
+			assert(frozen_get(frozen, string) == 0);
+		}
+		assert(frozen_get(frozen, "") == 0);
+		free_frozen_hash(frozen);
+	}
+
+	return 1;
+}
+
+/* Freeze a map holding two keys with the same prehashed hash.
+ * BEHAVIOR: Freezing fails, and the map is left as it was
+ */
+int freeze_same_hash()
+{
+	hash * obj = construct_hash(10);
+	int a = 1, b = 2;
+	assert(set_prehashed(obj, "Test1", 5, 42, &a));
+	assert(set_prehashed(obj, "Test2", 5, 42, &b));
+
+	assert(hash_freeze(obj) == 0);
+	assert(get_prehashed(obj, "Test1", 5, 42) == &a);
+	assert(get_prehashed(obj, "Test2", 5, 42) == &b);
+
+	// Data is on the stack, don't let free_hash() free it
+	delete_prehashed(obj, "Test1", 5, 42);
+	delete_prehashed(obj, "Test2", 5, 42);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* HASH FUNCTION TESTS */
+
+/* Build a map with each built-in hash function, seeded and not, and set,
+ * get and delete short and long keys in it, then save it to a snapshot.
+ * BEHAVIOR: Every map behaves the same whatever it hashes with, seeds
+ * change the hashes (but seed 0 of hash_cfarmhash is plain cfarmhash),
+ * and snapshots are looked up with the saved map's hash function
+ */
+int hash_function_choice()
+{
+	hash_function functions[] = {0, hash_cfarmhash, hash_superfasthash,
+		hash_short_key};
+	uint64_t seeds[] = {0, 0x1234567890abcdefULL};
+	char string[50];
+	int f = 0;
+	for(; f < 4; f++)
+	{
+		int s = 0;
+		for(; s < 2; s++)
+		{
+			hash_options options = {PROBE_GROUP, REDUCE_POW2, 0.75,
+				functions[f], seeds[s]};
+			hash * obj = construct_hash_with(0, &options);
+			int i = 0;
+			int * number;
+			for(; i < 5000; i++)
+			{
+				sprintf(string, i % 3 ? "%d" : "A longer test key %d", i);
+				number = malloc(sizeof(int));
+				*number = i;
+				assert(set(obj, string, number));
+			}
+			for(i = 0; i < 5000; i += 2)
+			{
+				sprintf(string, i % 3 ? "%d" : "A longer test key %d", i);
+				free(delete(obj, string));
+			}
+			for(i = 0; i < 5000; i++)
+			{
+				sprintf(string, i % 3 ? "%d" : "A longer test key %d", i);
+				number = get(obj, string);
+				assert(i % 2 ? *number == i : number == 0);
+			}
+			assert(hash_key(obj, "Test1", 5)
+				== (functions[f] ? functions[f] : hash_cfarmhash)("Test1", 5,
+					seeds[s]));
+
+			assert(hash_save(obj, "hash-function-test.tmp", sizeof(int)));
+			mapped_hash * mapped = hash_open_mmap("hash-function-test.tmp");
+			assert(*(const int *)mapped_get(mapped, "4999") == 4999);
+			assert(mapped_get(mapped, "4998") == 0);
+			hash_close_mmap(mapped);
+			free_hash(obj);
+		}
+		if(functions[f] != 0)
+		{
+			assert(functions[f]("Test1", 5, seeds[0])
+				!= functions[f]("Test1", 5, seeds[1]));
+		}
+	}
+	assert(hash_cfarmhash("Test1", 5, 0) == cfarmhash("Test1", 5));
+	remove("hash-function-test.tmp");
+
+	return 1;
+}
+
+/* Hash 2,000 keys of 0 to 99 bytes at once with cfarmhash_many(), seeded
+ * and not - in runs of the same length, of lengths mixed, and in batches
+ * of every size up to 20 - with each kind of lane that's built and that
+ * the CPU has, and with none.
+ * BEHAVIOR: Every hash is the one cfarmhash() gives the key alone
+ */
+int hash_many_same()
+{
+	enum { KEYS = 2000 };
+	static char bytes[KEYS * 100];
+	const char * keys[KEYS];
+	size_t lens[KEYS];
+	uint64_t hashes[KEYS];
+	int i = 0;
+	for(; i < KEYS * 100; i++)
+	{
+		bytes[i] = rand();
+	}
+	for(i = 0; i < KEYS; i++)
+	{
+		keys[i] = bytes + i * 100;
+		lens[i] = i < KEYS / 2 ? i / 10 : rand() % 100;
+	}
+
+	// Each kind of lane this build and CPU have, then the scalar loop
+	int lanes = CFARMHASH_AVX512;
+	for(; lanes >= CFARMHASH_SCALAR; lanes--)
+	{
+		if(cfarmhash_many_lanes(lanes) != lanes)
+		{
+			continue;
+		}
+		cfarmhash_many(keys, lens, KEYS, hashes);
+		for(i = 0; i < KEYS; i++)
+		{
+			assert(hashes[i] == cfarmhash(keys[i], lens[i]));
+		}
+		cfarmhash_many_with_seed(keys, lens, KEYS, 42, hashes);
+		for(i = 0; i < KEYS; i++)
+		{
+			assert(hashes[i] == cfarmhash_with_seed(keys[i], lens[i], 42));
+		}
+		int n = 0;
+		for(; n <= 20; n++)
+		{
+			cfarmhash_many(keys + 1000 + n, lens + 1000 + n, n, hashes);
+			for(i = 0; i < n; i++)
+			{
+				assert(hashes[i] == cfarmhash(keys[1000 + n + i],
+					lens[1000 + n + i]));
+			}
+		}
+	}
+	cfarmhash_many_lanes(CFARMHASH_AVX512);
+
+	return 1;
+}
+
+// Every key collides under seed 7, as if picked to
+static uint64_t colliding_hash(const char * key, size_t len, uint64_t seed)
+{
+	return seed == 7 ? 42 : hash_short_key(key, len, seed);
+}
+
+/* Set 2,000 keys that all share a hash in maps of each kind of probing,
+ * seeded so they collide and told to reseed past 16 probes. Then delete
+ * half of them. Construct maps that reseed without a seed, and a sharded
+ * map that does.
+ * BEHAVIOR: The maps move to another seed and every key is still found;
+ * maps that reseed start with random seeds of their own and hash with
+ * hash_short_key, and a sharded map's shards share one and never reseed
+ */
+int reseed_long_probes()
+{
+	hash_probing probings[] = {PROBE_LINEAR, PROBE_GROUP, PROBE_ROBIN_HOOD};
+	char string[50];
+	int p = 0;
+	for(; p < 3; p++)
+	{
+		hash_options options = {probings[p], REDUCE_POW2, 0.75,
+			colliding_hash, 7, 16};
+		hash * obj = construct_hash_with(0, &options);
+		int i = 0;
+		int * number;
+		for(; i < 2000; i++)
+		{
+			sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+			number = malloc(sizeof(int));
+			*number = i;
+			assert(set(obj, string, number));
+		}
+		assert(obj->seed != 7);
+		assert(obj->in_use == 2000);
+		for(i = 0; i < 2000; i += 2)
+		{
+			sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+			free(delete(obj, string));
+		}
+		for(i = 0; i < 2000; i++)
+		{
+			sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+			number = get(obj, string);
+			assert(i % 2 ? *number == i : number == 0);
+		}
+		free_hash(obj);
+	}
+
+	hash_options options = {PROBE_GROUP, REDUCE_POW2, 0.75, 0, 0, 64};
+	hash * first = construct_hash_with(10, &options);
+	hash * second = construct_hash_with(10, &options);
+	assert(first->seed != 0 && second->seed != 0);
+	assert(first->seed != second->seed);
+	assert(first->hash_with == hash_short_key);
+	free_hash(first);
+	free_hash(second);
+
+	sharded_hash * sharded = construct_sharded_hash(100, 4, &options);
+	assert(sharded_map(sharded, 0)->seed != 0);
+	unsigned int s = 0;
+	for(; s < 4; s++)
+	{
+		assert(sharded_map(sharded, s)->seed == sharded_map(sharded, 0)->seed);
+		assert(sharded_map(sharded, s)->reseed_at == 0);
+		assert(sharded_map(sharded, s)->hash_with == hash_short_key);
+	}
+	free_sharded_hash(sharded);
+
+	return 1;
+}
+
+/* Build a map of 40,000 cells from 10,000 pairs on 8 threads, seeded so
+ * every key has the same hash and told to reseed past 16 probes. The
+ * first region fills up, so the rest are set after the threads are done.
+ * BEHAVIOR: The map reseeds part way through the pairs set afterwards,
+ * and every key is still found
+ */
+int reseed_during_build()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_MODULO, 0, colliding_hash,
+		7, 16};
+	hash * obj = construct_hash_with(40000, &options);
+	const char ** keys = malloc(10000 * sizeof(char *));
+	size_t * lens = malloc(10000 * sizeof(size_t));
+	void ** vals = malloc(10000 * sizeof(void *));
+	char * strings = malloc(10000 * 20);
+	int i = 0;
+	for(; i < 10000; i++)
+	{
+		keys[i] = strings + i * 20;
+		lens[i] = sprintf(strings + i * 20, "Test%d", i);
+		int * number = malloc(sizeof(int));
+		*number = i;
+		vals[i] = number;
+	}
+
+	assert(hash_build(obj, keys, lens, vals, 10000, 8));
+	assert(obj->seed != 7);
+	assert(obj->in_use == 10000);
+	for(i = 0; i < 10000; i++)
+	{
+		int * number = get(obj, keys[i]);
+		assert(number != 0 && *number == i);
+	}
+
+	free_hash(obj);
+	free(strings);
+	free(vals);
+	free(lens);
+	free(keys);
+
+	return 1;
+}
+
+/* STATISTICS TESTS */
+
+/* In a map of 10 cells, set three keys with hash 0 and one with hash 5,
+ * then delete the second. Take stats of an empty map and a growing one.
+ * BEHAVIOR: Probe lengths, runs and displacements are those of cells 0-2
+ * and 5 (a tombstone in cell 1 keeps the run together); an empty map is
+ * all empty cells, and a growing map counts what's left in its old cells
+ */
+int stats_scan()
+{
+	hash * obj = construct_hash(10);
+	int a = 1, b = 2, c = 3, d = 4;
+	assert(set_prehashed(obj, "Test1", 5, 0, &a));
+	assert(set_prehashed(obj, "Test2", 5, 0, &b));
+	assert(set_prehashed(obj, "Test3", 5, 0, &c));
+	assert(set_prehashed(obj, "Test4", 5, 5, &d));
+
+	hash_statistics stats;
+	hash_stats(obj, &stats);
+	assert(stats.entries == 4 && stats.tombstones == 0 && stats.empty == 6);
+	assert(stats.mean_hit_probe == 1.75 && stats.max_hit_probe == 3);
+	assert(stats.mean_miss_probe == 1.7 && stats.max_miss_probe == 4);
+	assert(stats.runs == 2 && stats.max_run == 3);
+	assert(stats.run_lengths[1] == 1 && stats.run_lengths[2] == 1);
+	assert(stats.displacements[0] == 2 && stats.displacements[1] == 1
+		&& stats.displacements[2] == 1);
+
+	assert(delete_prehashed(obj, "Test2", 5, 0) == &b);
+	hash_stats(obj, &stats);
+	assert(stats.entries == 3 && stats.tombstones == 1 && stats.empty == 6);
+	assert(stats.max_hit_probe == 3);
+	assert(stats.runs == 2 && stats.max_run == 3);
+	assert(stats.mean_miss_probe == 1.7);
+	assert(stats.displacements[1] == 0 && stats.displacements[2] == 1);
+
+	// Data is on the stack, don't let free_hash() free it
+	delete_prehashed(obj, "Test1", 5, 0);
+	delete_prehashed(obj, "Test3", 5, 0);
+	delete_prehashed(obj, "Test4", 5, 5);
+	free_hash(obj);
+
+	obj = construct_hash(0);
+	hash_stats(obj, &stats);
+	assert(stats.entries == 0 && stats.empty == 0 && stats.runs == 0);
+	free_hash(obj);
+
+	hash_options options = {PROBE_LINEAR, REDUCE_POW2, 0.75};
+	obj = construct_hash_with(0, &options);
+	char string[50];
+	int i = 0;
+	for(; i < 1000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		int * number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+	}
+	hash_stats(obj, &stats);
+	assert(stats.entries + stats.unmoved == 1000);
+	assert(stats.entries + stats.tombstones + stats.empty == obj->size);
+	assert(stats.mean_hit_probe >= 1 && stats.mean_miss_probe >= 1);
+	unsigned long runs = 0, displaced = 0;
+	int bucket = 0;
+	for(; bucket < HASH_STATS_BUCKETS; bucket++)
+	{
+		runs += stats.run_lengths[bucket];
+		displaced += stats.displacements[bucket];
+	}
+	assert(runs == stats.runs && displaced == stats.entries);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* LATENCY TESTS */
+
+/* In a growing map, set 10,000 keys, get them all and 10,000 more, delete
+ * half, then reset the times.
+ * BEHAVIOR: Built with HASH_LATENCY, each operation counts one time, the
+ * percentiles never go down and max is the largest; reset clears them.
+ * Otherwise there's no report
+ */
+int latency_report()
+{
+	hash_options options = {PROBE_LINEAR, REDUCE_POW2, 0.75};
+	hash * obj = construct_hash_with(0, &options);
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 10000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+	}
+	for(i = 0; i < 20000; i++)
+	{
+		sprintf(string, "Test%d", i);
+		get(obj, string);
+	}
+	for(i = 0; i < 10000; i += 2)
+	{
+		sprintf(string, "Test%d", i);
+		free(delete(obj, string));
+	}
+
+	hash_latency report;
+	if(!hash_latency_report(obj, HASH_OP_GET, &report))
+	{
+		assert(obj->latency == 0);
+		free_hash(obj);
+		return 1;
+	}
+	uint64_t counts[] = {10000, 20000, 5000};
+	hash_operation op = HASH_OP_SET;
+	for(; op <= HASH_OP_DELETE; op++)
+	{
+		assert(hash_latency_report(obj, op, &report));
+		assert(report.count == counts[op]);
+		assert(report.p50 <= report.p99 && report.p99 <= report.p999
+			&& report.p999 <= report.max);
+		assert(report.max > 0);
+	}
+
+	hash_latency_reset(obj);
+	assert(hash_latency_report(obj, HASH_OP_SET, &report));
+	assert(report.count == 0 && report.p50 == 0 && report.max == 0);
+	free_hash(obj);
+
+	return 1;
+}
+
+/* SNAPSHOT TESTS */
+
+/* Save a map of 50,000 keys, short and long, while it's still growing,
+ * then map the snapshot and look up every key and as many that were never
+ * set. Save an empty map, a map without values, and a map with a null
+ * value, too, and open a snapshot with no empty slot.
+ * BEHAVIOR: The snapshot has a copy of every value, found by its key, and
+ * nothing for other keys; a null value is saved as zeroes, and a snapshot
+ * with no empty slot doesn't open
+ */
+int snapshot_save_open()
+{
+	hash_options options = {PROBE_GROUP, REDUCE_POW2, 0.75};
+	hash * obj = construct_hash_with(0, &options);
+
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 50000; i++)
+	{
+		sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+	}
+	assert(obj->old != 0);
+
+	assert(hash_save(obj, "snapshot-test.tmp", sizeof(int)));
+	mapped_hash * mapped = hash_open_mmap("snapshot-test.tmp");
+	assert(mapped != 0);
+	for(i = 0; i < 50000; i++)
+	{
+		sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+		assert(*(const int *)mapped_get(mapped, string) == i);
+		sprintf(string, "Missing%d", i);
+		assert(mapped_get(mapped, string) == 0);
+	}
+	hash_close_mmap(mapped);
+
+	// Keys only
+	assert(hash_save(obj, "snapshot-test.tmp", 0));
+	mapped = hash_open_mmap("snapshot-test.tmp");
+	assert(mapped_get(mapped, "Test1") != 0);
+	assert(mapped_get(mapped, "Missing1") == 0);
+	hash_close_mmap(mapped);
+	free_hash(obj);
+
+	obj = construct_hash(0);
+	assert(hash_save(obj, "snapshot-test.tmp", sizeof(int)));
+	mapped = hash_open_mmap("snapshot-test.tmp");
+	assert(mapped_get(mapped, "Test1") == 0);
+	hash_close_mmap(mapped);
+	free_hash(obj);
+
+	// A null value
+	obj = construct_hash(10);
+	assert(set(obj, "Test1", 0));
+	assert(hash_save(obj, "snapshot-test.tmp", sizeof(int)));
+	mapped = hash_open_mmap("snapshot-test.tmp");
+	assert(*(const int *)mapped_get(mapped, "Test1") == 0);
+	hash_close_mmap(mapped);
+	free_hash(obj);
+
+	// Damaged so that no slot is empty, where a miss would never stop
+	snapshot_header header;
+	FILE * file = fopen("snapshot-test.tmp", "r+b");
+	assert(fread(&header, sizeof(header), 1, file) == 1);
+	fseek(file, header.ctrl_offset, SEEK_SET);
+	uint64_t slot = 0;
+	for(; slot < header.slots; slot++)
+	{
+		fputc(1, file);
+	}
+	fclose(file);
+	assert(hash_open_mmap("snapshot-test.tmp") == 0);
+
+	// Not a snapshot at all
+	file = fopen("snapshot-test.tmp", "wb");
+	fputs("Not a snapshot, but long enough to have a header's worth of bytes"
+		" in it", file);
+	fclose(file);
+	assert(hash_open_mmap("snapshot-test.tmp") == 0);
+	remove("snapshot-test.tmp");
+	assert(hash_open_mmap("snapshot-test.tmp") == 0);
+
+	return 1;
+}
+
+/* WRITE-AHEAD LOG TESTS */
+
+/* Log 20,000 sets and 5,000 deletes, checkpoint halfway through, then
+ * recover a second map from the snapshot and log. Then tear the log's last
+ * record, as a crash mid-write would, and recover again. Recover into
+ * maps too small for it, and from a snapshot with a key out of bounds.
+ * BEHAVIOR: The recovered maps have the same keys and values as the
+ * logged one, less only the torn change; recovering into too small a map
+ * or from a damaged snapshot fails
+ */
+int wal_checkpoint_recover()
+{
+	remove("wal-test.tmp");
+	remove("wal-snapshot-test.tmp");
+	hash_options options = {PROBE_LINEAR, REDUCE_MODULO, 0.75};
+	hash * obj = construct_hash_with(0, &options);
+	assert(wal_attach(obj, "wal-test.tmp", sizeof(int), 5));
+
+	int i = 0;
+	int * number;
+	char string[50];
+	for(; i < 20000; i++)
+	{
+		sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+		number = malloc(sizeof(int));
+		*number = i;
+		assert(set(obj, string, number));
+		if(i % 4 == 0)
+		{
+			sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i / 2);
+			free(delete(obj, string));
+		}
+		if(i == 10000)
+		{
+			assert(wal_checkpoint(obj, "wal-snapshot-test.tmp"));
+		}
+	}
+	// Overwrite one last key, which the torn record will undo
+	int * replaced = get(obj, "Test1");
+	number = malloc(sizeof(int));
+	*number = -1;
+	assert(set(obj, "Test1", number));
+	free(replaced);
+	assert(wal_sync(obj));
+
+	hash * recovered = construct_hash_with(0, &options);
+	assert(wal_recover(recovered, "wal-snapshot-test.tmp", "wal-test.tmp",
+		sizeof(int)));
+	assert(recovered->in_use == obj->in_use);
+	for(i = 0; i < 20000; i++)
+	{
+		sprintf(string, i % 3 ? "Test%d" : "A longer test key %d", i);
+		number = get(obj, string);
+		int * other = get(recovered, string);
+		assert(number == 0 ? other == 0 : *other == *number);
+	}
+	free_hash(recovered);
+	free_hash(obj);
+
+	// Cut the last record short
+	FILE * file = fopen("wal-test.tmp", "rb+");
+	fseek(file, 0, SEEK_END);
+	long end = ftell(file);
+	fclose(file);
+	assert(truncate("wal-test.tmp", end - 2) == 0);
+
+	recovered = construct_hash_with(0, &options);
+	assert(wal_recover(recovered, "wal-snapshot-test.tmp", "wal-test.tmp",
+		sizeof(int)));
+	assert(*(int *)get(recovered, "Test1") == 1);
+	free_hash(recovered);
+
+	// A log of some other value_size won't attach
+	recovered = construct_hash(10);
+	assert(!wal_attach(recovered, "wal-test.tmp", sizeof(long), 5));
+	free_hash(recovered);
+
+	// Too small a map, for the snapshot and then for the log alone
+	recovered = construct_hash(10);
+	assert(!wal_recover(recovered, "wal-snapshot-test.tmp", "wal-test.tmp",
+		sizeof(int)));
+	free_hash(recovered);
+	recovered = construct_hash(10);
+	assert(!wal_recover(recovered, "wal-missing-test.tmp", "wal-test.tmp",
+		sizeof(int)));
+	free_hash(recovered);
+
+	// A snapshot whose first key is out of bounds
+	snapshot_header header;
+	file = fopen("wal-snapshot-test.tmp", "r+b");
+	assert(fread(&header, sizeof(header), 1, file) == 1);
+	fseek(file, header.ctrl_offset, SEEK_SET);
+	uint64_t slot = 0;
+	while(fgetc(file) == SNAPSHOT_EMPTY)
+	{
+		slot++;
+	}
+	uint64_t key_offset = header.file_size;
+	fseek(file, header.cells_offset + slot * sizeof(snapshot_cell)
+		+ offsetof(snapshot_cell, key_offset), SEEK_SET);
+	fwrite(&key_offset, sizeof(key_offset), 1, file);
+	fclose(file);
+	recovered = construct_hash_with(0, &options);
+	assert(!wal_recover(recovered, "wal-snapshot-test.tmp", "wal-test.tmp",
+		sizeof(int)));
+	free_hash(recovered);
+
+	remove("wal-test.tmp");
+	remove("wal-snapshot-test.tmp");
+
+	return 1;
+}
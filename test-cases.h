@@ -69,5 +69,85 @@ int load_million();
 static const char * whole_cycle_million_desc = "Set multiple times, get, delete, and check load factor of size 950,000";
 int whole_cycle_million();
 
+/* group probing test cases */
+static const char * group_same_cells_desc = "Group probing places keys in the same cells as linear probing";
+int group_same_cells();
+static const char * group_tiny_wrap_desc = "Set, get and delete in a group-probing map smaller than one group";
+int group_tiny_wrap();
+static const char * group_cycle_million_desc = "Set, get, miss and delete 950,000 values with group probing";
+int group_cycle_million();
+/* reduction policy test cases */
+static const char * reduce_sizes_desc = "Round map sizes for each reduction policy";
+int reduce_sizes();
+static const char * reduce_cycle_all_desc = "Fill, get, miss and delete with every reduction policy";
+int reduce_cycle_all();
+/* Robin Hood test cases */
+static const char * robin_hood_tiny_wrap_desc = "Set, get and delete in a full Robin Hood map of size 3";
+int robin_hood_tiny_wrap();
+static const char * robin_hood_churn_desc = "Delete and set 190,000 keys in a 95% full Robin Hood map";
+int robin_hood_churn();
+/* growth test cases */
+static const char * grow_from_zero_desc = "Grow maps of size 0 to 100,000 values with every probing scheme";
+int grow_from_zero();
+static const char * grow_prime_free_midway_desc = "Grow a prime-sized map and free it while growing";
+int grow_prime_free_midway();
+/* tombstone purge test cases */
+static const char * purge_after_delete_all_desc = "Reclaim was_used cells after deleting every key";
+int purge_after_delete_all();
+static const char * purge_churn_desc = "Delete and set 190,000 keys in a 95% full linearly probed map";
+int purge_churn();
+/* prehashed test cases */
+static const char * prehashed_two_maps_desc = "Set, get and delete 1,000 prehashed keys in two maps";
+int prehashed_two_maps();
+/* length-aware key test cases */
+static const char * binary_keys_desc = "Set, get and delete binary keys with embedded '\\0' bytes";
+int binary_keys();
+/* batched get test cases */
+static const char * get_many_mixed_desc = "Look up 20,000 hits and misses with get_many()";
+int get_many_mixed();
+/* stored key test cases */
+static const char * stored_keys_same_hash_desc = "Set, get and delete 200 keys that all have the same hash";
+int stored_keys_same_hash();
+static const char * stored_keys_long_churn_desc = "Set, delete and set again 60,000 keys of up to 400 bytes";
+int stored_keys_long_churn();
+/* concurrent test cases */
+static const char * concurrent_eight_threads_desc = "Set, get and delete 160,000 keys from 8 threads at once";
+int concurrent_eight_threads();
+static const char * concurrent_lock_free_reads_desc = "Look up keys without locks while 2 threads delete and set them";
+int concurrent_lock_free_reads();
+static const char * concurrent_lock_free_shared_home_desc = "Look up two keys with the same home cell while they're swapped";
+int concurrent_lock_free_shared_home();
+/* sharded test cases */
+static const char * sharded_four_threads_desc = "Set 100,000 keys from 4 threads into 16 shards";
+int sharded_four_threads();
+/* bulk build test cases */
+static const char * build_eight_threads_desc = "Build maps from 200,000 pairs on 8 threads";
+int build_eight_threads();
+/* frozen map test cases */
+static const char * freeze_sizes_desc = "Freeze maps of 0 to 100,000 keys and look them up";
+int freeze_sizes();
+static const char * freeze_same_hash_desc = "Fail to freeze a map with two keys of the same hash";
+int freeze_same_hash();
+/* hash function test cases */
+static const char * hash_function_choice_desc = "Build maps with each built-in hash function and seed";
+int hash_function_choice();
+static const char * hash_many_same_desc = "Hash 2,000 keys at once the same as one at a time";
+int hash_many_same();
+static const char * reseed_long_probes_desc = "Reseed maps whose keys all share a hash";
+int reseed_long_probes();
+static const char * reseed_during_build_desc = "Reseed a map part way through building it";
+int reseed_during_build();
+/* statistics test cases */
+static const char * stats_scan_desc = "Take probe and run statistics of a few maps";
+int stats_scan();
+/* latency test cases */
+static const char * latency_report_desc = "Report times of 35,000 operations with HASH_LATENCY";
+int latency_report();
+/* snapshot test cases */
+static const char * snapshot_save_open_desc = "Save 50,000 keys to a snapshot and look them up in it";
+int snapshot_save_open();
+/* write-ahead log test cases */
+static const char * wal_checkpoint_recover_desc = "Recover a map from a snapshot and a write-ahead log";
+int wal_checkpoint_recover();
 
 #endif
@@ -53,6 +53,73 @@ int main(int argc, char const *argv[])
   /* *** WHOLE_CYCLE TESTS *** */
     run_test(whole_cycle_million, whole_cycle_million_desc);
 
+  /* *** GROUP PROBING TESTS *** */
+    run_test(group_same_cells, group_same_cells_desc);
+    run_test(group_tiny_wrap, group_tiny_wrap_desc);
+    run_test(group_cycle_million, group_cycle_million_desc);
+
+  /* *** REDUCTION TESTS *** */
+    run_test(reduce_sizes, reduce_sizes_desc);
+    run_test(reduce_cycle_all, reduce_cycle_all_desc);
+
+  /* *** ROBIN HOOD TESTS *** */
+    run_test(robin_hood_tiny_wrap, robin_hood_tiny_wrap_desc);
+    run_test(robin_hood_churn, robin_hood_churn_desc);
+
+  /* *** GROWTH TESTS *** */
+    run_test(grow_from_zero, grow_from_zero_desc);
+    run_test(grow_prime_free_midway, grow_prime_free_midway_desc);
+
+  /* *** TOMBSTONE PURGE TESTS *** */
+    run_test(purge_after_delete_all, purge_after_delete_all_desc);
+    run_test(purge_churn, purge_churn_desc);
+
+  /* *** PREHASHED TESTS *** */
+    run_test(prehashed_two_maps, prehashed_two_maps_desc);
+
+  /* *** LENGTH-AWARE KEY TESTS *** */
+    run_test(binary_keys, binary_keys_desc);
+
+  /* *** BATCHED GET TESTS *** */
+    run_test(get_many_mixed, get_many_mixed_desc);
+
+  /* *** STORED KEY TESTS *** */
+    run_test(stored_keys_same_hash, stored_keys_same_hash_desc);
+    run_test(stored_keys_long_churn, stored_keys_long_churn_desc);
+
+  /* *** CONCURRENT TESTS *** */
+    run_test(concurrent_eight_threads, concurrent_eight_threads_desc);
+    run_test(concurrent_lock_free_reads, concurrent_lock_free_reads_desc);
+    run_test(concurrent_lock_free_shared_home, concurrent_lock_free_shared_home_desc);
+
+  /* *** SHARDED TESTS *** */
+    run_test(sharded_four_threads, sharded_four_threads_desc);
+
+  /* *** BULK BUILD TESTS *** */
+    run_test(build_eight_threads, build_eight_threads_desc);
+
+  /* *** FROZEN MAP TESTS *** */
+    run_test(freeze_sizes, freeze_sizes_desc);
+    run_test(freeze_same_hash, freeze_same_hash_desc);
+
+  /* *** HASH FUNCTION TESTS *** */
+    run_test(hash_function_choice, hash_function_choice_desc);
+    run_test(hash_many_same, hash_many_same_desc);
+    run_test(reseed_long_probes, reseed_long_probes_desc);
+    run_test(reseed_during_build, reseed_during_build_desc);
+
+  /* *** STATISTICS TESTS *** */
+    run_test(stats_scan, stats_scan_desc);
+
+  /* *** LATENCY TESTS *** */
+    run_test(latency_report, latency_report_desc);
+
+  /* *** SNAPSHOT TESTS *** */
+    run_test(snapshot_save_open, snapshot_save_open_desc);
+
+  /* *** WRITE-AHEAD LOG TESTS *** */
+    run_test(wal_checkpoint_recover, wal_checkpoint_recover_desc);
+
   // End the suite
     end_suite();
     return 0;
@@ -0,0 +1,416 @@
+#include "wal.h"
+#include "cfarmhash.h"
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Appends go to one buffer while the flusher writes out the other
+typedef struct
+{
+	int fd;
+	size_t value_size;
+	unsigned int window_ms;
+	pthread_t flusher;
+	pthread_mutex_t lock;
+	// Signalled to wake the flusher early, and when a sync has finished
+	pthread_cond_t wake;
+	pthread_cond_t synced;
+	char * buffer;
+	size_t used;
+	size_t capacity;
+	// Bytes appended since attaching, and how many of them are on disk
+	uint64_t appended;
+	uint64_t durable;
+	int sync_wanted;
+	// Set while the flusher writes a swapped out buffer without the lock
+	int flushing;
+	int stopping;
+	int failed;
+} wal_log;
+
+#define WAL_HEADER_SIZE 16
+#define WAL_RECORD_HEADER 16
+
+static void * flush_loop(void * arg);
+static int write_all(int fd, const char * bytes, size_t length);
+static int replay(hash * hash_map, const char * path, size_t value_size);
+
+int wal_attach(hash * hash_map, const char * path, size_t value_size,
+	unsigned int window_ms)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if(fd == -1)
+	{
+		return 0;
+	}
+
+	// A new log gets a header, an old one has to have been written with
+	// the same value_size
+	char header[WAL_HEADER_SIZE];
+	uint64_t magic = WAL_MAGIC;
+	uint32_t version = WAL_VERSION, size = value_size;
+	ssize_t got = pread(fd, header, WAL_HEADER_SIZE, 0);
+	if(got == 0)
+	{
+		memcpy(header, &magic, 8);
+		memcpy(header + 8, &version, 4);
+		memcpy(header + 12, &size, 4);
+		if(!write_all(fd, header, WAL_HEADER_SIZE) || fdatasync(fd) == -1)
+		{
+			close(fd);
+			return 0;
+		}
+	}
+	else if(got != WAL_HEADER_SIZE || memcmp(header, &magic, 8) != 0
+		|| memcmp(header + 8, &version, 4) != 0
+		|| memcmp(header + 12, &size, 4) != 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	wal_log * log = malloc(sizeof(wal_log));
+	log->fd = fd;
+	log->value_size = value_size;
+	log->window_ms = window_ms;
+	pthread_mutex_init(&log->lock, 0);
+	pthread_cond_init(&log->wake, 0);
+	pthread_cond_init(&log->synced, 0);
+	log->capacity = 65536;
+	log->buffer = malloc(log->capacity);
+	log->used = 0;
+	log->appended = 0;
+	log->durable = 0;
+	log->sync_wanted = 0;
+	log->flushing = 0;
+	log->stopping = 0;
+	log->failed = 0;
+	if(pthread_create(&log->flusher, 0, flush_loop, log) != 0)
+	{
+		free(log->buffer);
+		free(log);
+		close(fd);
+		return 0;
+	}
+
+	hash_map->wal = log;
+	return 1;
+}
+
+void wal_append(void * wal, int op, const char * key, size_t len,
+	const void * datum)
+{
+	wal_log * log = wal;
+	size_t value_size = op == WAL_SET ? log->value_size : 0;
+	uint32_t length = 8 + len + value_size;
+	uint32_t key_len = len;
+
+	pthread_mutex_lock(&log->lock);
+	if(log->used + 8 + length > log->capacity)
+	{
+		while(log->used + 8 + length > log->capacity)
+		{
+			log->capacity *= 2;
+		}
+		log->buffer = realloc(log->buffer, log->capacity);
+	}
+	char * record = log->buffer + log->used;
+	memset(record + 8, 0, 4);
+	record[8] = op;
+	memcpy(record + 12, &key_len, 4);
+	memcpy(record + WAL_RECORD_HEADER, key, len);
+	if(value_size != 0)
+	{
+		// set() with a null datum logs zeroes
+		if(datum != 0)
+		{
+			memcpy(record + WAL_RECORD_HEADER + len, datum, value_size);
+		}
+		else
+		{
+			memset(record + WAL_RECORD_HEADER + len, 0, value_size);
+		}
+	}
+	uint32_t check = cfarmhash(record + 8, length);
+	memcpy(record, &length, 4);
+	memcpy(record + 4, &check, 4);
+	log->used += 8 + length;
+	log->appended += 8 + length;
+	pthread_mutex_unlock(&log->lock);
+}
+
+int wal_sync(hash * hash_map)
+{
+	wal_log * log = hash_map->wal;
+	pthread_mutex_lock(&log->lock);
+	uint64_t target = log->appended;
+	while(log->durable < target && !log->failed)
+	{
+		log->sync_wanted = 1;
+		pthread_cond_signal(&log->wake);
+		pthread_cond_wait(&log->synced, &log->lock);
+	}
+	int ok = !log->failed;
+	pthread_mutex_unlock(&log->lock);
+	return ok;
+}
+
+void wal_detach(hash * hash_map)
+{
+	wal_log * log = hash_map->wal;
+	pthread_mutex_lock(&log->lock);
+	log->stopping = 1;
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->flusher, 0);
+
+	pthread_cond_destroy(&log->synced);
+	pthread_cond_destroy(&log->wake);
+	pthread_mutex_destroy(&log->lock);
+	close(log->fd);
+	free(log->buffer);
+	free(log);
+	hash_map->wal = 0;
+}
+
+int wal_checkpoint(hash * hash_map, const char * snapshot_path)
+{
+	wal_log * log = hash_map->wal;
+	if(!hash_save(hash_map, snapshot_path, log->value_size))
+	{
+		return 0;
+	}
+
+	// The snapshot has every change so far, so the log can start over.
+	// Anything still buffered is already in the snapshot too - as is a
+	// batch the flusher is writing, which has to land before the truncate
+	// rather than after it, where recovery would replay it.
+	pthread_mutex_lock(&log->lock);
+	while(log->flushing)
+	{
+		pthread_cond_wait(&log->synced, &log->lock);
+	}
+	int ok = ftruncate(log->fd, WAL_HEADER_SIZE) == 0
+		&& fdatasync(log->fd) == 0;
+	log->used = 0;
+	log->durable = log->appended;
+	pthread_cond_broadcast(&log->synced);
+	pthread_mutex_unlock(&log->lock);
+	return ok;
+}
+
+int wal_recover(hash * hash_map, const char * snapshot_path,
+	const char * wal_path, size_t value_size)
+{
+	if(access(snapshot_path, F_OK) == 0)
+	{
+		mapped_hash * mapped = hash_open_mmap(snapshot_path);
+		if(mapped == 0)
+		{
+			return 0;
+		}
+		const snapshot_header * header = mapped->base;
+		if(header->value_size != value_size)
+		{
+			hash_close_mmap(mapped);
+			return 0;
+		}
+		const char * base = mapped->base;
+		const unsigned char * ctrl = (const unsigned char *)base
+			+ header->ctrl_offset;
+		const snapshot_cell * cells = (const snapshot_cell *)(base
+			+ header->cells_offset);
+		int loaded = 1;
+		uint64_t i = 0;
+		for(; i < header->slots && loaded; i++)
+		{
+			if(ctrl[i] == SNAPSHOT_EMPTY)
+			{
+				continue;
+			}
+			// The same checks as mapped_get_n(), so a damaged snapshot
+			// can't send us outside the mapping
+			const snapshot_cell * cell = &cells[i];
+			if(header->keys_offset + cell->key_offset + cell->key_len
+					> header->file_size
+				|| cell->value_offset + value_size
+					> header->count * value_size)
+			{
+				loaded = 0;
+				break;
+			}
+			void * datum = malloc(value_size ? value_size : 1);
+			memcpy(datum, base + header->values_offset + cell->value_offset,
+				value_size);
+			// Hashed again, as the map may not hash the way the saved one did
+			if(!set_n(hash_map, base + header->keys_offset + cell->key_offset,
+				cell->key_len, datum))
+			{
+				free(datum);
+				loaded = 0;
+			}
+		}
+		hash_close_mmap(mapped);
+		if(!loaded)
+		{
+			return 0;
+		}
+	}
+
+	return access(wal_path, F_OK) != 0 || replay(hash_map, wal_path,
+		value_size);
+}
+
+// Applies every whole record in the log to the map
+static int replay(hash * hash_map, const char * path, size_t value_size)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		return 0;
+	}
+	off_t end = lseek(fd, 0, SEEK_END);
+	char * bytes = malloc(end > 0 ? end : 1);
+	int ok = end >= WAL_HEADER_SIZE && pread(fd, bytes, end, 0) == end;
+	close(fd);
+
+	uint64_t magic = WAL_MAGIC;
+	uint32_t version = WAL_VERSION, size = value_size;
+	ok = ok && memcmp(bytes, &magic, 8) == 0
+		&& memcmp(bytes + 8, &version, 4) == 0
+		&& memcmp(bytes + 12, &size, 4) == 0;
+
+	off_t at = WAL_HEADER_SIZE;
+	while(ok && at + 8 <= end)
+	{
+		uint32_t length, check, key_len;
+		memcpy(&length, bytes + at, 4);
+		memcpy(&check, bytes + at + 4, 4);
+		// A torn last record - everything before it still counts
+		if(length < 8 || at + 8 + length > end
+			|| (uint32_t)cfarmhash(bytes + at + 8, length) != check)
+		{
+			break;
+		}
+		const char * record = bytes + at;
+		memcpy(&key_len, record + 12, 4);
+		const char * key = record + WAL_RECORD_HEADER;
+		if(record[8] == WAL_SET && 8 + key_len + value_size == length)
+		{
+			// The map owns what it held for the key before
+			void * replaced = get_n(hash_map, key, key_len);
+			void * datum = malloc(value_size ? value_size : 1);
+			memcpy(datum, key + key_len, value_size);
+			if(set_n(hash_map, key, key_len, datum))
+			{
+				free(replaced);
+			}
+			else
+			{
+				// The map has no room for the key, so it would be lost
+				free(datum);
+				ok = 0;
+			}
+		}
+		else if(record[8] == WAL_DELETE && 8 + key_len == length)
+		{
+			free(delete_n(hash_map, key, key_len));
+		}
+		at += 8 + length;
+	}
+
+	free(bytes);
+	return ok;
+}
+
+// Wakes every window (or sooner, for wal_sync()) and syncs whatever was
+// appended since last time in one go
+static void * flush_loop(void * arg)
+{
+	wal_log * log = arg;
+	char * writing = malloc(log->capacity);
+	size_t writing_capacity = log->capacity;
+
+	pthread_mutex_lock(&log->lock);
+	for(;;)
+	{
+		if(!log->stopping && !log->sync_wanted)
+		{
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += log->window_ms / 1000;
+			until.tv_nsec += (log->window_ms % 1000) * 1000000L;
+			if(until.tv_nsec >= 1000000000L)
+			{
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&log->wake, &log->lock, &until);
+		}
+		int stopping = log->stopping;
+		log->sync_wanted = 0;
+
+		if(log->used != 0)
+		{
+			// Swap buffers, so set() can carry on appending meanwhile
+			char * full = log->buffer;
+			size_t full_capacity = log->capacity;
+			size_t length = log->used;
+			uint64_t target = log->appended;
+			log->buffer = writing;
+			log->capacity = writing_capacity;
+			log->used = 0;
+			writing = full;
+			writing_capacity = full_capacity;
+			log->flushing = 1;
+			pthread_mutex_unlock(&log->lock);
+
+			int ok = write_all(log->fd, writing, length)
+				&& fdatasync(log->fd) == 0;
+
+			pthread_mutex_lock(&log->lock);
+			log->flushing = 0;
+			if(!ok)
+			{
+				log->failed = 1;
+			}
+			if(target > log->durable)
+			{
+				log->durable = target;
+			}
+		}
+		pthread_cond_broadcast(&log->synced);
+
+		if(stopping && log->used == 0)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	free(writing);
+	return 0;
+}
+
+static int write_all(int fd, const char * bytes, size_t length)
+{
+	while(length != 0)
+	{
+		ssize_t written = write(fd, bytes, length);
+		if(written == -1)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return 0;
+		}
+		bytes += written;
+		length -= written;
+	}
+	return 1;
+}
@@ -0,0 +1,62 @@
+#ifndef WAL_H_INCLUDED
+#define WAL_H_INCLUDED
+
+#include "hash.h"
+
+// A write-ahead log for a map. Once one is attached, every set() and
+// delete() that changes the map also appends a record of the change to the
+// log's buffer. A flusher thread writes the buffer out and fdatasync()s it
+// once per window - so however many changes a window holds, they cost one
+// sync between them. A change can be lost if the machine goes down less
+// than a window after it; wal_sync() waits until everything so far is on
+// disk.
+//
+// Logs start with an 8-byte magic number, a version and the value_size
+// they were attached with (4 bytes each). Each record after that is:
+//   uint32 length of the rest of the record, after the check
+//   uint32 check, the low 32 bits of cfarmhash() over the rest
+//   uint8 WAL_SET or WAL_DELETE, then 3 bytes of padding
+//   uint32 key length, then the key's bytes
+//   for WAL_SET, value_size bytes copied from the datum
+// A record cut short by a crash fails its check, and ends the replay.
+#define WAL_MAGIC UINT64_C(0x314C41574243504B)
+#define WAL_VERSION 1
+#define WAL_SET 1
+#define WAL_DELETE 2
+
+// Attaches a log at path to the map, appending to whatever the file holds
+// already (replay it first - see wal_recover()). Data has to be flat, as
+// with hash_save(): records copy the first value_size bytes each datum
+// points to. window_ms is the longest a change waits to be synced.
+// Returns 0 if the log couldn't be opened, or was written with a different
+// value_size.
+int wal_attach(hash *, const char * path, size_t value_size,
+	unsigned int window_ms);
+
+// Waits until every change so far is synced to disk. Returns 0 if writing
+// the log failed.
+int wal_sync(hash *);
+
+// Syncs the log and detaches it. free_hash() does this too.
+void wal_detach(hash *);
+
+// Saves a snapshot of the map to snapshot_path and, once it's safely
+// there, empties the log - so the log only has to hold changes since the
+// last snapshot. Returns 0 if the snapshot couldn't be written, in which
+// case the log is left as it was.
+int wal_checkpoint(hash *, const char * snapshot_path);
+
+// Rebuilds a map after a restart: every key in the snapshot (if there is
+// one), then every change in the log (if there is one) in order. Values
+// are copied into memory of their own, which the map then owns. Call it on
+// an empty map with no log attached, then attach the log again. Returns 0
+// if either file is there but unreadable or damaged, or if the map can't
+// take every key (a fixed-size map that's too small, say).
+int wal_recover(hash *, const char * snapshot_path, const char * wal_path,
+	size_t value_size);
+
+// For set() and delete() - appends a record for a change to the map
+void wal_append(void * wal, int op, const char * key, size_t len,
+	const void * datum);
+
+#endif /* WAL_H_INCLUDED */